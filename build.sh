@@ -2,10 +2,28 @@
 
 set -ex
 
-CFLAGS="-Wall -Wextra -g"
+CFLAGS="-Wall -Wextra -g -pthread"
 
 gcc $CFLAGS -c md5c.c
+gcc $CFLAGS -c md5mb.c
+gcc $CFLAGS -c md5hmac.c
+gcc $CFLAGS -c mdpool.c
+gcc $CFLAGS -c mdcache.c
+gcc $CFLAGS -c mdchunk.c
+gcc $CFLAGS -c mdline.c
+gcc $CFLAGS -c mdsums.c
+gcc $CFLAGS -c mdbench.c
+gcc $CFLAGS -c mdstats.c
+gcc $CFLAGS -c mdout.c
+gcc $CFLAGS -c mdclient.c
+gcc $CFLAGS -c mdserve.c
+gcc $CFLAGS -c mdload.c
 gcc $CFLAGS -c mddriver.c
-gcc $CFLAGS -o mddriver md5c.o mddriver.o
+gcc $CFLAGS -o mddriver md5c.o md5mb.o md5hmac.o mdpool.o mdcache.o mdchunk.o mdline.o mdsums.o mdbench.o mdstats.o mdout.o mdclient.o mdserve.o mdload.o mddriver.o
 
 gcc $CFLAGS -o standalone-md5 standalone-md5.c
+
+g++ -std=c++20 -Wall -Wextra -fsyntax-only -x c++ md5.hpp
+g++ -std=c++20 -Wall -Wextra -fsyntax-only -x c++ md5hasher.hpp
+g++ -std=c++20 -Wall -Wextra -g -o md5hashertest md5hashertest.cpp md5c.o
+./md5hashertest
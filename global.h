@@ -1,5 +1,6 @@
 /* GLOBAL.H - RSAREF types and constants */
 
+#include <stddef.h>
 #include <stdint.h>
 
 typedef uint8_t u8;
@@ -24,10 +24,75 @@
 /* MD5 context. */
 typedef struct {
     u32 state[4];  /* state (ABCD) */
-    u32 count[2];  /* number of bits, modulo 2^64 (lsb first) */
+    u64 count;     /* number of bits, modulo 2^64 */
     u8 buffer[64]; /* input buffer */
 } MD5_CTX;
 
 void MD5Init(MD5_CTX *);
 void MD5Update(MD5_CTX *, u8 *, u32);
+void MD5Update64(MD5_CTX *, const u8 *, u64);
 void MD5Final(u8[16], MD5_CTX *);
+void MD5TransformBlocks(u32[4], u8 *, u32);
+void MD5Short(const u8 *, u8, u8[16]);
+void MD5Fixed16(const u8[16], u8[16]);
+void MD5Fixed32(const u8[32], u8[16]);
+void MD5Fixed64(const u8[64], u8[16]);
+void MD5Clone(MD5_CTX *, const MD5_CTX *);
+
+/* Statistics, counted only while enabled with MD5StatsEnable, and not at
+ * all when built with MD5_NO_STATS. */
+typedef struct {
+    u64 updates;    /* MD5Update calls */
+    u64 bytes;      /* bytes digested, by any API but MD5Short/MD5Fixed* */
+    u64 blocks;     /* blocks through the single-stream kernel */
+    u64 laneBlocks; /* blocks through the multi-buffer kernels, per lane */
+} MD5_STATS;
+
+void MD5StatsEnable(i32);
+void MD5StatsRead(MD5_STATS *);
+
+/* Serialized contexts; see MD5Export for the format. */
+#define MD5_EXPORT_LEN 96
+#define MD5_EXPORT_VERSION 1
+void MD5Export(u8[MD5_EXPORT_LEN], const MD5_CTX *);
+i32 MD5Import(MD5_CTX *, u8[MD5_EXPORT_LEN]);
+
+/* Transform kernel selection. The best kernels for the running CPU are
+ * picked at startup; MD5_KERNEL=name[,name] in the environment or
+ * MD5SetKernel override them. */
+i32 MD5SetKernel(const char *);
+const char *MD5KernelName(u32);
+u32 MD5KernelLanes(const char *);
+const char *MD5Kernel(void);
+const char *MD5LaneKernel(void);
+u32 MD5MaxLanes(void);
+
+/* Multi-buffer MD5 (MD5MB.C). Lane i transforms nblocks consecutive
+ * 64-byte blocks of input[i] into state[i]. The 8- and 16-lane variants
+ * need AVX2 and AVX-512F respectively; see MD5MaxLanes. */
+void MD5TransformX4(u32 *[4], u8 *[4], u32);
+void MD5TransformX8(u32 *[8], u8 *[8], u32);
+void MD5TransformX16(u32 *[16], u8 *[16], u32);
+void MD5UpdateLanes(MD5_CTX *[], u8 *[], u32[], u32);
+void MD5Batch(const u8 **, const u64 *, u8 (*)[16], size_t);
+void MD5Fixed16N(const u8 *, size_t, u8 (*)[16]);
+void MD5Fixed32N(const u8 *, size_t, u8 (*)[16]);
+void MD5Fixed64N(const u8 *, size_t, u8 (*)[16]);
+
+/* Chunked (multipart) MD5 (MD5MB.C). MD5Parts digests each fixed-size
+ * part of an input; MD5Multipart folds part digests into the digest of
+ * their concatenation. */
+u64 MD5Parts(const u8 *, u64, u64, u8 (*)[16]);
+void MD5Multipart(u8[16], u8 (*)[16], u64);
+
+/* HMAC-MD5 (MD5HMAC.C). An MD5_HMAC_KEY holds the contexts after the
+ * inner and outer key pads; set it up once per key with MD5HmacKey. */
+typedef struct {
+    MD5_CTX inner;
+    MD5_CTX outer;
+} MD5_HMAC_KEY;
+
+void MD5HmacKey(MD5_HMAC_KEY *, u8 *, u32);
+void MD5HmacInit(MD5_CTX *, MD5_HMAC_KEY *);
+void MD5HmacFinal(u8[16], MD5_CTX *, MD5_HMAC_KEY *);
+void MD5Hmac(u8[16], MD5_HMAC_KEY *, u8 *, u32);
@@ -0,0 +1,287 @@
+/* MD5.HPP - header-only constexpr C++ port of MD5C.C */
+
+/* Copyright (C) 1991-2, RSA Data Security, Inc. Created 1991. All
+ * rights reserved.
+ *
+ * License to copy and use this software is granted provided that it
+ * is identified as the "RSA Data Security, Inc. MD5 Message-Digest
+ * Algorithm" in all material mentioning or referencing this software
+ * or this function.
+ *
+ * License is also granted to make and use derivative works provided
+ * that such works are identified as "derived from the RSA Data
+ * Security, Inc. MD5 Message-Digest Algorithm" in all material
+ * mentioning or referencing the derived work.
+ *
+ * RSA Data Security, Inc. makes no representations concerning either
+ * the merchantability of this software or the suitability of this
+ * software for any particular purpose. It is provided "as is"
+ * without express or implied warranty of any kind.
+ *
+ * These notices must be retained in any copies of any part of this
+ * documentation and/or software. */
+
+/* The MD5Init/MD5Update/MD5Final core as C++20 templates. Everything is
+ * constexpr, so that md5::md5("literal") can be a compile-time constant,
+ * and nothing is out of line, so that at run time the 64 steps unroll
+ * into the caller with the state in registers. Requires C++20. */
+
+#ifndef MD5_HPP
+#define MD5_HPP
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <string_view>
+#include <utility>
+
+/* The core is forced inline; left to itself the compiler keeps the
+ * unrolled rounds out of line once they have several callers. */
+#if defined(__GNUC__) || defined(__clang__)
+#define MD5_HPP_INLINE [[gnu::always_inline]]
+#else
+#define MD5_HPP_INLINE
+#endif
+
+namespace md5 {
+
+using digest = std::array<std::uint8_t, 16>;
+
+namespace detail {
+
+using u8 = std::uint8_t;
+using u32 = std::uint32_t;
+using u64 = std::uint64_t;
+
+/* Additive constants of steps 1 to 64 (RFC 1321, 3.4). */
+inline constexpr u32 sine[64] = {
+    0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a,
+    0xa8304613, 0xfd469501, 0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be,
+    0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821, 0xf61e2562, 0xc040b340,
+    0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+    0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8,
+    0x676f02d9, 0x8d2a4c8a, 0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c,
+    0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70, 0x289b7ec6, 0xeaa127fa,
+    0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+    0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92,
+    0xffeff47d, 0x85845dd1, 0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1,
+    0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391};
+
+/* Rotation amounts, four per round. */
+inline constexpr u32 shift[4][4] = {
+    {7, 12, 17, 22}, {5, 9, 14, 20}, {4, 11, 16, 23}, {6, 10, 15, 21}};
+
+/* Message word used by step i. */
+constexpr std::size_t word(std::size_t i) {
+    switch (i / 16) {
+    case 0: return i % 16;
+    case 1: return (1 + 5 * i) % 16;
+    case 2: return (5 + 3 * i) % 16;
+    default: return (7 * i) % 16;
+    }
+}
+
+constexpr u32 rotl(u32 x, u32 n) { return (x << n) | (x >> (32 - n)); }
+
+/* Loads the little-endian word at p, which points to bytes of any
+ * byte-like type. */
+template <class T> MD5_HPP_INLINE constexpr u32 load(const T *p) {
+    return static_cast<u32>(static_cast<u8>(p[0])) |
+           static_cast<u32>(static_cast<u8>(p[1])) << 8 |
+           static_cast<u32>(static_cast<u8>(p[2])) << 16 |
+           static_cast<u32>(static_cast<u8>(p[3])) << 24;
+}
+
+/* Step I of the 64. The registers rotate through v rather than being
+ * renamed, so every index is a constant and v stays in registers. */
+template <std::size_t I>
+MD5_HPP_INLINE constexpr void step(u32 (&v)[4], const u32 (&x)[16]) {
+    constexpr std::size_t a = (4 - I % 4) % 4, b = (a + 1) % 4,
+                          c = (a + 2) % 4, d = (a + 3) % 4;
+    u32 f;
+    if constexpr (I < 16) {
+        f = (v[b] & v[c]) | (~v[b] & v[d]);
+    } else if constexpr (I < 32) {
+        f = (v[b] & v[d]) | (v[c] & ~v[d]);
+    } else if constexpr (I < 48) {
+        f = v[b] ^ v[c] ^ v[d];
+    } else {
+        f = v[c] ^ (v[b] | ~v[d]);
+    }
+    v[a] = v[b] + rotl(v[a] + f + x[word(I)] + sine[I], shift[I / 16][I % 4]);
+}
+
+template <std::size_t... I>
+MD5_HPP_INLINE constexpr void rounds(u32 (&v)[4], const u32 (&x)[16],
+                                     std::index_sequence<I...>) {
+    (step<I>(v, x), ...);
+}
+
+/* Transforms state based on the 64-byte block at p. */
+template <class T>
+MD5_HPP_INLINE constexpr void transform(u32 (&state)[4], const T *p) {
+    u32 x[16];
+    for (std::size_t i = 0; i < 16; i++) {
+        x[i] = load(p + 4 * i);
+    }
+
+    u32 v[4] = {state[0], state[1], state[2], state[3]};
+    rounds(v, x, std::make_index_sequence<64>{});
+    for (std::size_t i = 0; i < 4; i++) {
+        state[i] += v[i];
+    }
+}
+
+} // namespace detail
+
+/* MD5 context, the counterpart of MD5_CTX. Construction is MD5Init,
+ * update is MD5Update and finalize is MD5Final. */
+class context {
+  public:
+    constexpr void update(std::string_view input) {
+        absorb(input.data(), input.size());
+    }
+    constexpr void update(std::span<const std::byte> input) {
+        absorb(input.data(), input.size());
+    }
+    constexpr void update(std::span<const std::uint8_t> input) {
+        absorb(input.data(), input.size());
+    }
+
+    /* Pads the message and returns its digest. The context is spent
+     * afterwards. */
+    MD5_HPP_INLINE constexpr digest finalize() {
+        std::size_t index = count % 64;
+        detail::u64 bits = count * 8;
+
+        buffer[index++] = 0x80;
+        if (index > 56) {
+            while (index < 64) {
+                buffer[index++] = 0;
+            }
+            detail::transform(state, buffer);
+            index = 0;
+        }
+        while (index < 56) {
+            buffer[index++] = 0;
+        }
+        for (std::size_t i = 0; i < 8; i++) {
+            buffer[56 + i] = static_cast<detail::u8>(bits >> (8 * i));
+        }
+        detail::transform(state, buffer);
+
+        digest out{};
+        for (std::size_t i = 0; i < 16; i++) {
+            out[i] = static_cast<detail::u8>(state[i / 4] >> (8 * (i % 4)));
+        }
+        return out;
+    }
+
+  private:
+    /* Absorbs len bytes of input, of any byte-like type. Whole blocks
+     * are transformed in place; only partial ones are buffered. */
+    template <class T>
+    MD5_HPP_INLINE constexpr void absorb(const T *input, std::size_t len) {
+        std::size_t index = count % 64;
+        count += len;
+
+        std::size_t i = 0;
+        if (index != 0) {
+            for (; i < len && index < 64; i++) {
+                buffer[index++] = static_cast<detail::u8>(input[i]);
+            }
+            if (index < 64) {
+                return;
+            }
+            detail::transform(state, buffer);
+        }
+        for (; len - i >= 64; i += 64) {
+            detail::transform(state, input + i);
+        }
+        for (index = 0; i < len; i++) {
+            buffer[index++] = static_cast<detail::u8>(input[i]);
+        }
+    }
+
+    detail::u32 state[4] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476};
+    detail::u64 count = 0; /* bytes */
+    detail::u8 buffer[64] = {};
+};
+
+/* Digests input in one call. */
+constexpr digest md5(std::string_view input) {
+    context c;
+    c.update(input);
+    return c.finalize();
+}
+
+constexpr digest md5(std::span<const std::byte> input) {
+    context c;
+    c.update(input);
+    return c.finalize();
+}
+
+constexpr digest md5(std::span<const std::uint8_t> input) {
+    context c;
+    c.update(input);
+    return c.finalize();
+}
+
+/* Returns the lowercase hex form of d, as the driver prints it. */
+constexpr std::array<char, 32> hex(const digest &d) {
+    std::array<char, 32> out{};
+    for (std::size_t i = 0; i < 16; i++) {
+        out[2 * i] = "0123456789abcdef"[d[i] >> 4];
+        out[2 * i + 1] = "0123456789abcdef"[d[i] & 0xf];
+    }
+    return out;
+}
+
+namespace detail {
+
+/* Compile-time checks against the MDTestSuite vectors (RFC 1321, A.5),
+ * taking both the string and the byte span paths, and a split update
+ * across a block boundary. */
+constexpr bool matches(const digest &d, std::string_view expected) {
+    auto h = hex(d);
+    return std::string_view(h.data(), h.size()) == expected;
+}
+
+constexpr digest split(std::string_view input, std::size_t at) {
+    context c;
+    c.update(input.substr(0, at));
+    c.update(input.substr(at));
+    return c.finalize();
+}
+
+inline constexpr std::byte abc[] = {std::byte{'a'}, std::byte{'b'},
+                                    std::byte{'c'}};
+
+static_assert(matches(md5(""), "d41d8cd98f00b204e9800998ecf8427e"));
+static_assert(matches(md5("a"), "0cc175b9c0f1b6a831c399e269772661"));
+static_assert(matches(md5("abc"), "900150983cd24fb0d6963f7d28e17f72"));
+static_assert(matches(md5(std::span(abc)),
+                      "900150983cd24fb0d6963f7d28e17f72"));
+static_assert(matches(md5("message digest"),
+                      "f96b697d7cb7938d525a2f31aaf161d0"));
+static_assert(matches(md5("abcdefghijklmnopqrstuvwxyz"),
+                      "c3fcd3d76192e4007dfb496cca67e13b"));
+static_assert(matches(md5("ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz"
+                          "0123456789"),
+                      "d174ab98d277d9f5a5611c2c9f419d9f"));
+static_assert(matches(md5("1234567890123456789012345678901234567890"
+                          "1234567890123456789012345678901234567890"),
+                      "57edf4a22be3c955ac49da2e2107b67a"));
+static_assert(matches(split("1234567890123456789012345678901234567890"
+                            "1234567890123456789012345678901234567890",
+                            61),
+                      "57edf4a22be3c955ac49da2e2107b67a"));
+
+} // namespace detail
+
+} // namespace md5
+
+#undef MD5_HPP_INLINE
+
+#endif
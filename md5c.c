@@ -23,28 +23,26 @@
 
 #include "global.h"
 #include "md5.h"
-
-/* Constants for MD5Transform routine. */
-
-#define S11 7
-#define S12 12
-#define S13 17
-#define S14 22
-#define S21 5
-#define S22 9
-#define S23 14
-#define S24 20
-#define S31 4
-#define S32 11
-#define S33 16
-#define S34 23
-#define S41 6
-#define S42 10
-#define S43 15
-#define S44 21
-
-static void MD5Transform(u32[4], u8[64]);
-static void Encode(u8 *, u32 *, u32);
+#include "md5round.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define MD5_X86
+#define TARGET(isa) __attribute__((target(isa)))
+#else
+#define TARGET(isa)
+#endif
+
+static void MD5BlocksScalar(u32[4], u8 *, u32, u32[16]);
+#ifdef MD5_X86
+static void MD5BlocksBMI2(u32[4], u8 *, u32, u32[16]);
+#endif
+static void TransformUnscrubbed(u32[4], u8 *, u32, u32[16]);
+static void FixedDigest(const u8 *, u32, u8[16]);
+static void Encode(u8 *, const u32 *, u32);
+static void EncodeCount(u8[8], u64);
 static void Decode(u32 *, u8 *, u32);
 static void MD5_memcpy(POINTER, POINTER, u32);
 static void MD5_memset(POINTER, i32, u32);
@@ -54,45 +52,40 @@ static u8 PADDING[64] = {0x80, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
                          0,    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
                          0,    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
 
-/* F, G, H and I are basic MD5 functions. */
-#define F(x, y, z) (((x) & (y)) | ((~x) & (z)))
-#define G(x, y, z) (((x) & (z)) | ((y) & (~z)))
-#define H(x, y, z) ((x) ^ (y) ^ (z))
-#define I(x, y, z) ((y) ^ ((x) | (~z)))
-
-/* ROTATE_LEFT rotates x left n bits. */
-#define ROTATE_LEFT(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
-
-/* FF, GG, HH, and II transformations for rounds 1, 2, 3, and 4.
- * Rotation is separate from addition to prevent recomputation. */
-#define FF(a, b, c, d, x, s, ac)                                               \
-    {                                                                          \
-        (a) += F((b), (c), (d)) + (x) + (u32)(ac);                             \
-        (a) = ROTATE_LEFT((a), (s));                                           \
-        (a) += (b);                                                            \
-    }
-#define GG(a, b, c, d, x, s, ac)                                               \
-    {                                                                          \
-        (a) += G((b), (c), (d)) + (x) + (u32)(ac);                             \
-        (a) = ROTATE_LEFT((a), (s));                                           \
-        (a) += (b);                                                            \
-    }
-#define HH(a, b, c, d, x, s, ac)                                               \
-    {                                                                          \
-        (a) += H((b), (c), (d)) + (x) + (u32)(ac);                             \
-        (a) = ROTATE_LEFT((a), (s));                                           \
-        (a) += (b);                                                            \
-    }
-#define II(a, b, c, d, x, s, ac)                                               \
-    {                                                                          \
-        (a) += I((b), (c), (d)) + (x) + (u32)(ac);                             \
-        (a) = ROTATE_LEFT((a), (s));                                           \
-        (a) += (b);                                                            \
-    }
+/* Transform kernels, in increasing order of preference. A kernel either
+ * replaces the single-stream transform or sets the multi-buffer width. */
+enum { CPU_ANY, CPU_SSE2, CPU_BMI2, CPU_AVX2, CPU_AVX512F };
+typedef void MD5_BLOCKS(u32[4], u8 *, u32, u32[16]);
+typedef struct {
+    const char *name;
+    i32 cpu;            /* required CPU feature */
+    MD5_BLOCKS *blocks; /* single-stream kernel, or NULL */
+    u32 lanes;          /* multi-buffer width, or 0 */
+} MD5_KERNEL;
+
+static const MD5_KERNEL kernels[] = {
+    {"scalar", CPU_ANY, MD5BlocksScalar, 0},
+#ifdef MD5_X86
+    {"bmi2", CPU_BMI2, MD5BlocksBMI2, 0},
+#endif
+    {"sse2", CPU_SSE2, NULL, 4},
+    {"avx2", CPU_AVX2, NULL, 8},
+    {"avx512", CPU_AVX512F, NULL, 16},
+};
+#define KERNELS ((u32)(sizeof(kernels) / sizeof(kernels[0])))
+
+/* Statistics; see MD5_COUNT. */
+i32 md5StatsEnabled = 0;
+MD5_STATS md5Stats;
+
+/* Active kernels; chosen by MD5SelectKernels at startup. */
+static const MD5_KERNEL *transformKernel = &kernels[0];
+static const MD5_KERNEL *laneKernel = NULL;
+static MD5_BLOCKS *MD5Blocks = MD5BlocksScalar;
 
 /* MD5 initialization. Begins an MD5 operation, writing a new context. */
 void MD5Init(MD5_CTX *context /* context */) {
-    context->count[0] = context->count[1] = 0;
+    context->count = 0;
     /* Load magic initialization constants. */
     context->state[0] = 0x67452301;
     context->state[1] = 0xefcdab89;
@@ -105,26 +98,43 @@ void MD5Init(MD5_CTX *context /* context */) {
  * context. */
 void MD5Update(MD5_CTX *context /* context */, u8 *input /* input block */,
                u32 inputLen /* length of input block */) {
+    MD5Update64(context, input, inputLen);
+}
+
+/* MD5 block update operation for inputs of any length. Like MD5Update,
+ * but takes a 64-bit length, so that a whole mapping or buffer goes in
+ * one call. */
+void MD5Update64(MD5_CTX *context, const u8 *input, u64 inputLen) {
+    u32 x[16]; /* message schedule of all the blocks of this call */
+    MD5_COUNT(updates, 1);
+    MD5_COUNT(bytes, inputLen);
+
     /* Compute number of bytes mod 64 */
-    u32 index = (u32)((context->count[0] >> 3) & 0x3F);
+    u32 index = (u32)((context->count >> 3) & 0x3F);
 
     /* Update number of bits */
-    if ((context->count[0] += ((u32)inputLen << 3)) < ((u32)inputLen << 3))
-        context->count[1]++;
-    context->count[1] += ((u32)inputLen >> 29);
+    context->count += inputLen << 3;
 
     u32 partLen = 64 - index;
 
     /* Transform as many times as possible. */
-    u32 i;
+    u64 i;
     if (inputLen >= partLen) {
         MD5_memcpy((POINTER)&context->buffer[index], (POINTER)input, partLen);
-        MD5Transform(context->state, context->buffer);
-
-        for (i = partLen; i + 63 < inputLen; i += 64) {
-            MD5Transform(context->state, &input[i]);
+        TransformUnscrubbed(context->state, context->buffer, 1, x);
+
+        /* The kernels take a 32-bit block count. */
+        u64 nblocks = (inputLen - partLen) / 64;
+        for (i = partLen; nblocks > 0;) {
+            u32 n = (nblocks < 0x1000000) ? (u32)nblocks : 0x1000000;
+            TransformUnscrubbed(context->state, (u8 *)&input[i], n, x);
+            i += (u64)64 * n;
+            nblocks -= n;
         }
 
+        /* Zeroize sensitive information, once for the whole call. */
+        MD5_memset((POINTER)x, 0, sizeof(x));
+
         index = 0;
     } else {
         i = 0;
@@ -132,7 +142,7 @@ void MD5Update(MD5_CTX *context /* context */, u8 *input /* input block */,
 
     /* Buffer remaining input */
     MD5_memcpy((POINTER)&context->buffer[index], (POINTER)&input[i],
-               inputLen - i);
+               (u32)(inputLen - i));
 }
 
 /* MD5 finalization. Ends an MD5 message-digest operation, writing the
@@ -141,15 +151,19 @@ void MD5Final(u8 digest[16] /* message digest */,
               MD5_CTX *context /* context */) {
     /* Save number of bits */
     u8 bits[8];
-    Encode(bits, context->count, 8);
+    EncodeCount(bits, context->count);
 
     /* Pad out to 56 mod 64. */
-    u32 index = (u32)((context->count[0] >> 3) & 0x3f);
+    u32 index = (u32)((context->count >> 3) & 0x3f);
     u32 padLen = (index < 56) ? (56 - index) : (120 - index);
-    MD5Update(context, PADDING, padLen);
+    MD5Update64(context, PADDING, padLen);
 
     /* Append length (before padding) */
-    MD5Update(context, bits, 8);
+    MD5Update64(context, bits, 8);
+
+    /* Padding is not input; take it back out of the statistics. */
+    MD5_COUNT(updates, (u64)-2);
+    MD5_COUNT(bytes, -(u64)(padLen + 8));
 
     /* Store state in digest */
     Encode(digest, context->state, 16);
@@ -158,88 +172,318 @@ void MD5Final(u8 digest[16] /* message digest */,
     MD5_memset((POINTER)context, 0, sizeof(*context));
 }
 
-/* MD5 basic transformation. Transforms state based on block. */
-static void MD5Transform(u32 state[4], u8 block[64]) {
-    u32 a = state[0], b = state[1], c = state[2], d = state[3], x[16];
-
-    Decode(x, block, 64);
-
-    /* Round 1 */
-    FF(a, b, c, d, x[0], S11, 0xd76aa478);  /* 1 */
-    FF(d, a, b, c, x[1], S12, 0xe8c7b756);  /* 2 */
-    FF(c, d, a, b, x[2], S13, 0x242070db);  /* 3 */
-    FF(b, c, d, a, x[3], S14, 0xc1bdceee);  /* 4 */
-    FF(a, b, c, d, x[4], S11, 0xf57c0faf);  /* 5 */
-    FF(d, a, b, c, x[5], S12, 0x4787c62a);  /* 6 */
-    FF(c, d, a, b, x[6], S13, 0xa8304613);  /* 7 */
-    FF(b, c, d, a, x[7], S14, 0xfd469501);  /* 8 */
-    FF(a, b, c, d, x[8], S11, 0x698098d8);  /* 9 */
-    FF(d, a, b, c, x[9], S12, 0x8b44f7af);  /* 10 */
-    FF(c, d, a, b, x[10], S13, 0xffff5bb1); /* 11 */
-    FF(b, c, d, a, x[11], S14, 0x895cd7be); /* 12 */
-    FF(a, b, c, d, x[12], S11, 0x6b901122); /* 13 */
-    FF(d, a, b, c, x[13], S12, 0xfd987193); /* 14 */
-    FF(c, d, a, b, x[14], S13, 0xa679438e); /* 15 */
-    FF(b, c, d, a, x[15], S14, 0x49b40821); /* 16 */
-
-    /* Round 2 */
-    GG(a, b, c, d, x[1], S21, 0xf61e2562);  /* 17 */
-    GG(d, a, b, c, x[6], S22, 0xc040b340);  /* 18 */
-    GG(c, d, a, b, x[11], S23, 0x265e5a51); /* 19 */
-    GG(b, c, d, a, x[0], S24, 0xe9b6c7aa);  /* 20 */
-    GG(a, b, c, d, x[5], S21, 0xd62f105d);  /* 21 */
-    GG(d, a, b, c, x[10], S22, 0x2441453);  /* 22 */
-    GG(c, d, a, b, x[15], S23, 0xd8a1e681); /* 23 */
-    GG(b, c, d, a, x[4], S24, 0xe7d3fbc8);  /* 24 */
-    GG(a, b, c, d, x[9], S21, 0x21e1cde6);  /* 25 */
-    GG(d, a, b, c, x[14], S22, 0xc33707d6); /* 26 */
-    GG(c, d, a, b, x[3], S23, 0xf4d50d87);  /* 27 */
-    GG(b, c, d, a, x[8], S24, 0x455a14ed);  /* 28 */
-    GG(a, b, c, d, x[13], S21, 0xa9e3e905); /* 29 */
-    GG(d, a, b, c, x[2], S22, 0xfcefa3f8);  /* 30 */
-    GG(c, d, a, b, x[7], S23, 0x676f02d9);  /* 31 */
-    GG(b, c, d, a, x[12], S24, 0x8d2a4c8a); /* 32 */
-
-    /* Round 3 */
-    HH(a, b, c, d, x[5], S31, 0xfffa3942);  /* 33 */
-    HH(d, a, b, c, x[8], S32, 0x8771f681);  /* 34 */
-    HH(c, d, a, b, x[11], S33, 0x6d9d6122); /* 35 */
-    HH(b, c, d, a, x[14], S34, 0xfde5380c); /* 36 */
-    HH(a, b, c, d, x[1], S31, 0xa4beea44);  /* 37 */
-    HH(d, a, b, c, x[4], S32, 0x4bdecfa9);  /* 38 */
-    HH(c, d, a, b, x[7], S33, 0xf6bb4b60);  /* 39 */
-    HH(b, c, d, a, x[10], S34, 0xbebfbc70); /* 40 */
-    HH(a, b, c, d, x[13], S31, 0x289b7ec6); /* 41 */
-    HH(d, a, b, c, x[0], S32, 0xeaa127fa);  /* 42 */
-    HH(c, d, a, b, x[3], S33, 0xd4ef3085);  /* 43 */
-    HH(b, c, d, a, x[6], S34, 0x4881d05);   /* 44 */
-    HH(a, b, c, d, x[9], S31, 0xd9d4d039);  /* 45 */
-    HH(d, a, b, c, x[12], S32, 0xe6db99e5); /* 46 */
-    HH(c, d, a, b, x[15], S33, 0x1fa27cf8); /* 47 */
-    HH(b, c, d, a, x[2], S34, 0xc4ac5665);  /* 48 */
-
-    /* Round 4 */
-    II(a, b, c, d, x[0], S41, 0xf4292244);  /* 49 */
-    II(d, a, b, c, x[7], S42, 0x432aff97);  /* 50 */
-    II(c, d, a, b, x[14], S43, 0xab9423a7); /* 51 */
-    II(b, c, d, a, x[5], S44, 0xfc93a039);  /* 52 */
-    II(a, b, c, d, x[12], S41, 0x655b59c3); /* 53 */
-    II(d, a, b, c, x[3], S42, 0x8f0ccc92);  /* 54 */
-    II(c, d, a, b, x[10], S43, 0xffeff47d); /* 55 */
-    II(b, c, d, a, x[1], S44, 0x85845dd1);  /* 56 */
-    II(a, b, c, d, x[8], S41, 0x6fa87e4f);  /* 57 */
-    II(d, a, b, c, x[15], S42, 0xfe2ce6e0); /* 58 */
-    II(c, d, a, b, x[6], S43, 0xa3014314);  /* 59 */
-    II(b, c, d, a, x[13], S44, 0x4e0811a1); /* 60 */
-    II(a, b, c, d, x[4], S41, 0xf7537e82);  /* 61 */
-    II(d, a, b, c, x[11], S42, 0xbd3af235); /* 62 */
-    II(c, d, a, b, x[2], S43, 0x2ad7d2bb);  /* 63 */
-    II(b, c, d, a, x[9], S44, 0xeb86d391);  /* 64 */
-
-    state[0] += a;
-    state[1] += b;
-    state[2] += c;
-    state[3] += d;
+/* Short message-digest operation. Digests the len bytes at input into
+ * digest. Messages of up to 55 bytes fit in one padded block, built on
+ * the stack and compressed once, with no context; longer ones take the
+ * MD5Init/MD5Update/MD5Final path. */
+void MD5Short(const u8 *input, u8 len, u8 digest[16]) {
+    if (len > 55) {
+        MD5_CTX context;
+        MD5Init(&context);
+        MD5Update(&context, (u8 *)input, len);
+        MD5Final(digest, &context);
+        return;
+    }
+
+    u8 block[64];
+    memset(block, 0, sizeof(block));
+    memcpy(block, input, len);
+    block[len] = 0x80;
+    block[56] = (u8)(len << 3);
+    block[57] = (u8)(len >> 5);
+
+    u32 state[4] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476}, x[16];
+    MD5Blocks(state, block, 1, x);
+    Encode(digest, state, 16);
+
+    /* Zeroize sensitive information. */
+    MD5_memset((POINTER)block, 0, sizeof(block));
+    MD5_memset((POINTER)x, 0, sizeof(x));
+}
+
+/* Fixed-length message-digest operations. Digest a 16-, 32- or 64-byte
+ * message into digest, with the padding and length words folded into
+ * the rounds as constants. */
+void MD5Fixed16(const u8 input[16], u8 digest[16]) {
+    FixedDigest(input, 16, digest);
+}
+
+void MD5Fixed32(const u8 input[32], u8 digest[16]) {
+    FixedDigest(input, 32, digest);
+}
+
+void MD5Fixed64(const u8 input[64], u8 digest[16]) {
+    FixedDigest(input, 64, digest);
+}
+
+/* Context clone. Copies context to copy, so that both can go on with
+ * different input; only the buffered part of the input block is
+ * copied. */
+void MD5Clone(MD5_CTX *copy, const MD5_CTX *context) {
+    copy->state[0] = context->state[0];
+    copy->state[1] = context->state[1];
+    copy->state[2] = context->state[2];
+    copy->state[3] = context->state[3];
+    copy->count = context->count;
+
+    u32 index = (u32)((context->count >> 3) & 0x3f);
+    memcpy(copy->buffer, context->buffer, index);
+}
+
+/* Context export. Writes context to output in a stable external form:
+ *   0  "MD5C"
+ *   4  version (1), then 3 zero bytes
+ *   8  state, 4 words little-endian
+ *   24 bit count, 64 bits little-endian
+ *   32 input buffer; bytes past the buffered input are zero
+ * The context is left unchanged. */
+void MD5Export(u8 output[MD5_EXPORT_LEN], const MD5_CTX *context) {
+    MD5_memset((POINTER)output, 0, MD5_EXPORT_LEN);
+    memcpy(output, "MD5C", 4);
+    output[4] = MD5_EXPORT_VERSION;
+    Encode(output + 8, context->state, 16);
+    EncodeCount(output + 24, context->count);
+
+    u32 index = (u32)((context->count >> 3) & 0x3f);
+    memcpy(output + 32, context->buffer, index);
+}
+
+/* Context import. Restores a context written by MD5Export, so that the
+ * operation can continue where it left off. Returns -1, with context
+ * untouched, if input is not an exported context of a known version. */
+i32 MD5Import(MD5_CTX *context, u8 input[MD5_EXPORT_LEN]) {
+    if (memcmp(input, "MD5C", 4) != 0 || input[4] != MD5_EXPORT_VERSION ||
+        input[5] != 0 || input[6] != 0 || input[7] != 0) {
+        return -1;
+    }
+
+    Decode(context->state, input + 8, 16);
+    u32 count[2];
+    Decode(count, input + 24, 8);
+    context->count = ((u64)count[1] << 32) | count[0];
+    MD5_memcpy((POINTER)context->buffer, (POINTER)input + 32, 64);
+    return 0;
+}
+
+/* Turns statistics on (nonzero) or off. Counters keep their values. */
+void MD5StatsEnable(i32 enable) {
+    __atomic_store_n(&md5StatsEnabled, enable != 0, __ATOMIC_RELAXED);
+}
+
+/* Reads the statistics counted so far into stats. */
+void MD5StatsRead(MD5_STATS *stats) {
+#ifdef MD5_NO_STATS
+    memset(stats, 0, sizeof(*stats));
+#else
+    stats->updates = __atomic_load_n(&md5Stats.updates, __ATOMIC_RELAXED);
+    stats->bytes = __atomic_load_n(&md5Stats.bytes, __ATOMIC_RELAXED);
+    stats->blocks = __atomic_load_n(&md5Stats.blocks, __ATOMIC_RELAXED);
+    stats->laneBlocks =
+        __atomic_load_n(&md5Stats.laneBlocks, __ATOMIC_RELAXED);
+#endif
+}
+
+/* Returns whether the running CPU can execute kernel. On other
+ * architectures the multi-buffer kernels are portable vector code. */
+static i32 KernelSupported(const MD5_KERNEL *kernel) {
+#ifdef MD5_X86
+    switch (kernel->cpu) {
+    case CPU_SSE2: return __builtin_cpu_supports("sse2");
+    case CPU_BMI2: return __builtin_cpu_supports("bmi2");
+    case CPU_AVX2: return __builtin_cpu_supports("avx2");
+    case CPU_AVX512F: return __builtin_cpu_supports("avx512f");
+    default: return 1;
+    }
+#else
+    (void)kernel;
+    return 1;
+#endif
+}
+
+/* Makes the named kernel active. Returns 0 on success, or -1 if the
+ * kernel is unknown or not supported by the running CPU. Not to be
+ * called while other threads are hashing. */
+i32 MD5SetKernel(const char *name) {
+    for (u32 i = 0; i < KERNELS; i++) {
+        const MD5_KERNEL *kernel = &kernels[i];
+        if (strcmp(kernel->name, name) != 0 || !KernelSupported(kernel)) {
+            continue;
+        }
+
+        if (kernel->blocks != NULL) {
+            transformKernel = kernel;
+            MD5Blocks = kernel->blocks;
+        } else {
+            laneKernel = kernel;
+        }
+        return 0;
+    }
+    return -1;
+}
+
+/* Returns the name of the i-th kernel the running CPU supports, or NULL
+ * once i is past the last one. */
+const char *MD5KernelName(u32 i) {
+    for (u32 k = 0; k < KERNELS; k++) {
+        if (KernelSupported(&kernels[k]) && i-- == 0) {
+            return kernels[k].name;
+        }
+    }
+    return NULL;
+}
+
+/* Returns the multi-buffer width of the named kernel, or 0 if it is a
+ * single-stream kernel or unknown. */
+u32 MD5KernelLanes(const char *name) {
+    for (u32 k = 0; k < KERNELS; k++) {
+        if (strcmp(kernels[k].name, name) == 0) {
+            return kernels[k].lanes;
+        }
+    }
+    return 0;
+}
+
+/* Returns the name of the active single-stream kernel. */
+const char *MD5Kernel(void) { return transformKernel->name; }
+
+/* Returns the name of the active multi-buffer kernel. */
+const char *MD5LaneKernel(void) {
+    return (laneKernel != NULL) ? laneKernel->name : "sse2";
+}
+
+/* Returns the lane count of the active multi-buffer kernel. */
+u32 MD5MaxLanes(void) { return (laneKernel != NULL) ? laneKernel->lanes : 4; }
+
+/* Selects the best supported kernels once at startup, then applies the
+ * comma-separated kernel names in MD5_KERNEL, if set. */
+__attribute__((constructor)) static void MD5SelectKernels(void) {
+#ifdef MD5_X86
+    __builtin_cpu_init();
+#endif
+    for (u32 i = 0; i < KERNELS; i++) {
+        if (KernelSupported(&kernels[i])) {
+            MD5SetKernel(kernels[i].name);
+        }
+    }
+
+    const char *env = getenv("MD5_KERNEL");
+    while (env != NULL && *env != '\0') {
+        char name[16];
+        size_t len = strcspn(env, ",");
+        if (len < sizeof(name)) {
+            memcpy(name, env, len);
+            name[len] = '\0';
+            MD5SetKernel(name);
+        }
+        env += len + (env[len] == ',');
+    }
+}
+
+/* MD5 multi-block transformation. Transforms state based on nblocks
+ * consecutive blocks, keeping a, b, c, d in registers throughout. On
+ * little-endian hosts the message words are loaded directly. The message
+ * schedule is left in x; the caller zeroizes it. */
+static inline __attribute__((always_inline)) void
+TransformBlocks(u32 state[4], u8 *data, u32 nblocks, u32 x[16]) {
+    u32 a = state[0], b = state[1], c = state[2], d = state[3];
+
+    for (u32 n = 0; n < nblocks; n++, data += 64) {
+        u32 aa = a, bb = b, cc = c, dd = d;
+
+        if (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__) {
+            memcpy(x, data, 64);
+        } else {
+            Decode(x, data, 64);
+        }
+
+        MD5_ROUNDS(a, b, c, d, x);
+
+        a += aa;
+        b += bb;
+        c += cc;
+        d += dd;
+    }
+
+    state[0] = a;
+    state[1] = b;
+    state[2] = c;
+    state[3] = d;
+}
+
+/* Portable scalar kernel. */
+static void MD5BlocksScalar(u32 state[4], u8 *data, u32 nblocks,
+                            u32 x[16]) {
+    TransformBlocks(state, data, nblocks, x);
+}
+
+#ifdef MD5_X86
+/* The scalar kernel compiled for BMI2, where the rotations become
+ * flag-free rorx instructions. */
+TARGET("bmi2")
+static void MD5BlocksBMI2(u32 state[4], u8 *data, u32 nblocks,
+                          u32 x[16]) {
+    TransformBlocks(state, data, nblocks, x);
+}
+#endif
+
+/* Transforms state based on nblocks consecutive 64-byte blocks, using
+ * the active single-stream kernel. */
+void MD5TransformBlocks(u32 state[4], u8 *data, u32 nblocks) {
+    u32 x[16];
+    TransformUnscrubbed(state, data, nblocks, x);
+
+    /* Zeroize sensitive information. */
+    MD5_memset((POINTER)x, 0, sizeof(x));
+}
+
+/* MD5TransformBlocks, leaving the message schedule in x for the caller
+ * to zeroize, so that MD5Update64 does it once per call. */
+static void TransformUnscrubbed(u32 state[4], u8 *data, u32 nblocks,
+                                u32 x[16]) {
+    MD5_COUNT(blocks, nblocks);
+    if (nblocks > 0) {
+        MD5Blocks(state, data, nblocks, x);
+    }
+}
+
+/* Digests the len bytes at input, where len is 16, 32 or 64 and a
+ * constant after inlining. A 64-byte message takes a second block that
+ * is all padding. */
+static inline __attribute__((always_inline)) void
+FixedDigest(const u8 *input, u32 len, u8 digest[16]) {
+    u32 x[16];
+    if (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__) {
+        memcpy(x, input, len);
+    } else {
+        Decode(x, (u8 *)input, len);
+    }
+    if (len < 64) {
+        MD5_PAD_WORDS(x, len / 4, 8 * len, 0);
+    }
+
+    u32 state[4] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476};
+    u32 a = state[0], b = state[1], c = state[2], d = state[3];
+    MD5_ROUNDS(a, b, c, d, x);
+    a += state[0];
+    b += state[1];
+    c += state[2];
+    d += state[3];
+
+    if (len == 64) {
+        u32 aa = a, bb = b, cc = c, dd = d;
+        MD5_PAD_WORDS(x, 0, 512, 0);
+        MD5_ROUNDS(a, b, c, d, x);
+        a += aa;
+        b += bb;
+        c += cc;
+        d += dd;
+    }
+
+    state[0] = a;
+    state[1] = b;
+    state[2] = c;
+    state[3] = d;
+    Encode(digest, state, 16);
 
     /* Zeroize sensitive information. */
     MD5_memset((POINTER)x, 0, sizeof(x));
@@ -247,7 +491,7 @@ static void MD5Transform(u32 state[4], u8 block[64]) {
 
 /* Encodes input (u32) into output (u8). Assumes len is
  * a multiple of 4. */
-static void Encode(u8 *output, u32 *input, u32 len) {
+static void Encode(u8 *output, const u32 *input, u32 len) {
     for (u32 i = 0, j = 0; j < len; i++, j += 4) {
         output[j] = (u8)(input[i] & 0xff);
         output[j + 1] = (u8)((input[i] >> 8) & 0xff);
@@ -256,6 +500,13 @@ static void Encode(u8 *output, u32 *input, u32 len) {
     }
 }
 
+/* Encodes the bit count into 8 bytes, low word first, as MD5 appends
+ * it. */
+static void EncodeCount(u8 output[8], u64 count) {
+    u32 words[2] = {(u32)count, (u32)(count >> 32)};
+    Encode(output, words, 8);
+}
+
 /* Decodes input (u8) into output (u32). Assumes len is
  *  a multiple of 4. */
 static void Decode(u32 *output, u8 *input, u32 len) {
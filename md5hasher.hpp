@@ -0,0 +1,156 @@
+/* MD5HASHER.HPP - C++ streaming hasher over MD5C.C */
+
+/* md5::hasher owns an MD5_CTX and feeds it through MD5Update64, so it
+ * runs on the kernels MD5C.C selects and takes const input of any
+ * length. Input is always hashed where it lies: the iovec overload and
+ * md5::hashbuf pass caller buffers straight to MD5Update64, with no
+ * staging copy and no allocation. Link with md5c.o. */
+
+#ifndef MD5HASHER_HPP
+#define MD5HASHER_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <span>
+#include <streambuf>
+#include <string_view>
+#include <sys/uio.h>
+
+extern "C" {
+#include "global.h"
+#include "md5.h"
+}
+
+#include "md5.hpp"
+
+namespace md5 {
+
+/* Streaming MD5 operation. Move-only, as a context holds message data;
+ * clone() copies one explicitly. The context is zeroized when the
+ * hasher is destroyed, and when it is moved from, which leaves it
+ * starting a new message. */
+class hasher {
+  public:
+    hasher() noexcept { MD5Init(&ctx); }
+    ~hasher() { wipe(); }
+
+    hasher(const hasher &) = delete;
+    hasher &operator=(const hasher &) = delete;
+
+    hasher(hasher &&other) noexcept : ctx(other.ctx) {
+        other.wipe();
+        other.reset();
+    }
+    hasher &operator=(hasher &&other) noexcept {
+        if (this != &other) {
+            ctx = other.ctx;
+            other.wipe();
+            other.reset();
+        }
+        return *this;
+    }
+
+    /* Returns a hasher that goes on from the same point (MD5Clone). */
+    hasher clone() const noexcept {
+        hasher copy;
+        MD5Clone(&copy.ctx, &ctx);
+        return copy;
+    }
+
+    hasher &update(std::span<const std::byte> input) noexcept {
+        MD5Update64(&ctx, reinterpret_cast<const u8 *>(input.data()),
+                    input.size());
+        return *this;
+    }
+    hasher &update(std::span<const std::uint8_t> input) noexcept {
+        MD5Update64(&ctx, input.data(), input.size());
+        return *this;
+    }
+    hasher &update(std::string_view input) noexcept {
+        MD5Update64(&ctx, reinterpret_cast<const u8 *>(input.data()),
+                    input.size());
+        return *this;
+    }
+
+    /* Hashes the n buffers of a scatter-gather list in order. */
+    hasher &update(const struct iovec *iov, std::size_t n) noexcept {
+        for (std::size_t i = 0; i < n; i++) {
+            MD5Update64(&ctx, static_cast<const u8 *>(iov[i].iov_base),
+                        iov[i].iov_len);
+        }
+        return *this;
+    }
+
+    /* Returns the digest of the message so far (MD5Final) and starts a
+     * new one. */
+    digest finalize() noexcept {
+        digest out;
+        MD5Final(out.data(), &ctx);
+        MD5Init(&ctx);
+        return out;
+    }
+
+    /* Discards the message so far. */
+    void reset() noexcept { MD5Init(&ctx); }
+
+    /* The underlying context, for the C API (MD5Export and so on). */
+    MD5_CTX *native() noexcept { return &ctx; }
+
+  private:
+    /* Zeroizes the context; volatile so the stores are not dropped as
+     * dead. */
+    void wipe() noexcept {
+        volatile u8 *p = reinterpret_cast<volatile u8 *>(&ctx);
+        for (std::size_t i = 0; i < sizeof(ctx); i++) {
+            p[i] = 0;
+        }
+    }
+
+    MD5_CTX ctx;
+};
+
+/* Stream buffer that hashes everything written to it into a hasher. It
+ * has no put area, so std::ostream::write and string insertions reach
+ * xsputn with the caller's own buffer. */
+class hashbuf : public std::streambuf {
+  public:
+    explicit hashbuf(hasher &h) noexcept : sink(h) {}
+
+  protected:
+    std::streamsize xsputn(const char *s, std::streamsize n) override {
+        sink.update(std::string_view(s, static_cast<std::size_t>(n)));
+        return n;
+    }
+
+    int_type overflow(int_type c) override {
+        if (!traits_type::eq_int_type(c, traits_type::eof())) {
+            char ch = traits_type::to_char_type(c);
+            sink.update(std::string_view(&ch, 1));
+        }
+        return traits_type::not_eof(c);
+    }
+
+  private:
+    hasher &sink;
+};
+
+/* Output stream that hashes what is written to it:
+ *   md5::hashstream out;
+ *   out << header << body;
+ *   md5::digest d = out.finalize(); */
+class hashstream : public std::ostream {
+  public:
+    hashstream() : std::ostream(nullptr), buf(h) { rdbuf(&buf); }
+
+    digest finalize() noexcept { return h.finalize(); }
+    hasher &get() noexcept { return h; }
+
+  private:
+    hasher h;
+    hashbuf buf;
+};
+
+} // namespace md5
+
+#endif
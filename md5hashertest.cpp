@@ -0,0 +1,98 @@
+/* MD5HASHERTEST.CPP - checks MD5HASHER.HPP against MD5.HPP */
+
+/* Digests messages of several lengths through md5::hasher, whole, split
+ * in two, as an iovec list and through md5::hashstream, and compares
+ * every digest with the constexpr md5::md5. Also checks clone, and that
+ * a moved-from hasher starts a new message. Built and run by build.sh;
+ * exits non-zero on a failure. */
+
+#include "md5hasher.hpp"
+
+#include <cstdio>
+#include <utility>
+#include <vector>
+
+namespace {
+
+/* Counts the failed checks. */
+int failed = 0;
+
+void check(bool ok, const char *what, std::size_t len) {
+    if (!ok) {
+        std::printf("md5::hasher %s failed at %zu bytes\n", what, len);
+        failed++;
+    }
+}
+
+} // namespace
+
+int main() {
+    std::vector<std::uint8_t> data(3000);
+    std::uint64_t x = 0x9e3779b97f4a7c15;
+    for (auto &b : data) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        b = static_cast<std::uint8_t>(x);
+    }
+
+    static const std::size_t lens[] = {0,  1,   55,  56,   63,
+                                       64, 65,  127, 128,  1000,
+                                       3000};
+    for (std::size_t len : lens) {
+        std::span<const std::uint8_t> message(data.data(), len);
+        md5::digest expected = md5::md5(message);
+
+        md5::hasher whole;
+        check(whole.update(message).finalize() == expected, "update", len);
+
+        for (std::size_t split : {std::size_t(0), len / 3, len}) {
+            md5::hasher h;
+            h.update(message.first(split)).update(message.subspan(split));
+            check(h.finalize() == expected, "split update", len);
+
+            md5::hasher first;
+            first.update(message.first(split));
+            md5::hasher copy = first.clone();
+            copy.update(message.subspan(split));
+            check(copy.finalize() == expected, "clone", len);
+        }
+
+        struct iovec iov[3];
+        std::size_t a = len / 4, b = len / 2;
+        iov[0] = {data.data(), a};
+        iov[1] = {data.data() + a, b - a};
+        iov[2] = {data.data() + b, len - b};
+        md5::hasher gathered;
+        check(gathered.update(iov, 3).finalize() == expected, "iovec", len);
+
+        md5::hashstream out;
+        const char *chars = reinterpret_cast<const char *>(data.data());
+        out.write(chars, static_cast<std::streamsize>(a));
+        if (a < len) {
+            out.put(chars[a]);
+            out << std::string_view(chars + a + 1, len - a - 1);
+        }
+        check(out.finalize() == expected, "hashstream", len);
+    }
+
+    /* A moved-from hasher starts a new message; finalize starts over. */
+    md5::hasher from;
+    from.update(std::string_view("abc"));
+    md5::hasher to = std::move(from);
+    check(to.finalize() == md5::md5("abc"), "move", 3);
+    check(to.finalize() == md5::md5(""), "finalize twice", 0);
+    from.update(std::string_view("xyz"));
+    check(from.finalize() == md5::md5("xyz"), "moved-from", 3);
+
+    md5::hasher assigned;
+    assigned.update(std::string_view("stale"));
+    from.update(std::string_view("message digest"));
+    assigned = std::move(from);
+    check(assigned.finalize() == md5::md5("message digest"), "move assign",
+          14);
+    check(from.finalize() == md5::md5(""), "moved-from assign", 0);
+
+    std::printf("md5::hasher test: %s\n", failed ? "failed" : "passed");
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,71 @@
+/* MD5HMAC.C - HMAC-MD5 (RFC 2104) with precomputed key midstates */
+
+/* The inner and outer key pads fill one block each, so their compression
+ * only depends on the key. MD5HmacKey runs both once and keeps the
+ * resulting contexts; every message then starts from a clone of them,
+ * and a short message takes two compressions instead of four. */
+
+#include "global.h"
+#include "md5.h"
+
+#include <string.h>
+
+/* HMAC key setup. Absorbs the key pads of key into hmac. Keys longer
+ * than a block are hashed first. */
+void MD5HmacKey(MD5_HMAC_KEY *hmac, u8 *key, u32 keyLen) {
+    u8 hashed[16];
+    if (keyLen > 64) {
+        MD5_CTX context;
+        MD5Init(&context);
+        MD5Update(&context, key, keyLen);
+        MD5Final(hashed, &context);
+        key = hashed;
+        keyLen = 16;
+    }
+
+    u8 pad[64];
+    memset(pad, 0x36, sizeof(pad));
+    for (u32 i = 0; i < keyLen; i++) {
+        pad[i] ^= key[i];
+    }
+    MD5Init(&hmac->inner);
+    MD5Update(&hmac->inner, pad, 64);
+
+    for (u32 i = 0; i < 64; i++) {
+        pad[i] ^= 0x36 ^ 0x5c;
+    }
+    MD5Init(&hmac->outer);
+    MD5Update(&hmac->outer, pad, 64);
+
+    /* Zeroize sensitive information. */
+    memset(pad, 0, sizeof(pad));
+    memset(hashed, 0, sizeof(hashed));
+}
+
+/* HMAC initialization. Begins a message under hmac in context; the
+ * message is then absorbed with MD5Update. */
+void MD5HmacInit(MD5_CTX *context, MD5_HMAC_KEY *hmac) {
+    MD5Clone(context, &hmac->inner);
+}
+
+/* HMAC finalization. Ends the message in context and writes its HMAC
+ * under hmac, zeroizing the context. */
+void MD5HmacFinal(u8 mac[16], MD5_CTX *context, MD5_HMAC_KEY *hmac) {
+    u8 inner[16];
+    MD5Final(inner, context);
+
+    MD5Clone(context, &hmac->outer);
+    MD5Update(context, inner, 16);
+    MD5Final(mac, context);
+
+    /* Zeroize sensitive information. */
+    memset(inner, 0, sizeof(inner));
+}
+
+/* One-shot HMAC of the len bytes at input under hmac. */
+void MD5Hmac(u8 mac[16], MD5_HMAC_KEY *hmac, u8 *input, u32 len) {
+    MD5_CTX context;
+    MD5HmacInit(&context, hmac);
+    MD5Update(&context, input, len);
+    MD5HmacFinal(mac, &context, hmac);
+}
@@ -0,0 +1,704 @@
+/* MD5MB.C - multi-buffer MD5, hashing independent messages in SIMD lanes */
+
+/* Copyright (C) 1991-2, RSA Data Security, Inc. Created 1991. All
+ * rights reserved.
+ *
+ * License to copy and use this software is granted provided that it
+ * is identified as the "RSA Data Security, Inc. MD5 Message-Digest
+ * Algorithm" in all material mentioning or referencing this software
+ * or this function.
+ *
+ * License is also granted to make and use derivative works provided
+ * that such works are identified as "derived from the RSA Data
+ * Security, Inc. MD5 Message-Digest Algorithm" in all material
+ * mentioning or referencing the derived work.
+ *
+ * RSA Data Security, Inc. makes no representations concerning either
+ * the merchantability of this software or the suitability of this
+ * software for any particular purpose. It is provided "as is"
+ * without express or implied warranty of any kind.
+ *
+ * These notices must be retained in any copies of any part of this
+ * documentation and/or software. */
+
+#include "global.h"
+#include "md5.h"
+#include "md5round.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define MD5_MB_X86
+#define TARGET(isa) __attribute__((target(isa)))
+#else
+#define TARGET(isa)
+#endif
+
+/* One u32 per lane. */
+typedef u32 v4u32 __attribute__((vector_size(16)));
+typedef u32 v8u32 __attribute__((vector_size(32)));
+typedef u32 v16u32 __attribute__((vector_size(64)));
+
+static u32 LaneWidth(u32, u64);
+static void TransformLanes(u32, u32 **, u8 **, u32);
+static void MD5Count(MD5_CTX *, u32);
+static int CompareBlocks(const void *, const void *);
+static void FixedN(const u8 *, u32, size_t, u8 (*)[16]);
+static void FixedX4(const u8 *, u32, u8 (*)[16]);
+static void FixedX8(const u8 *, u32, u8 (*)[16]);
+static void FixedX16(const u8 *, u32, u8 (*)[16]);
+
+#ifdef MD5_MB_X86
+/* Loads the first groups groups of four words of the block at offset off
+ * of every lane, transposed so that x[i] holds message word i of all
+ * lanes. Each group is read with one 16-byte load per lane and a 4x4
+ * transpose. */
+TARGET("sse2")
+static inline void LoadX4(v4u32 x[16], u8 *input[4], u32 off, u32 groups) {
+    for (u32 g = 0; g < groups; g++) {
+        __m128i r0 = _mm_loadu_si128((__m128i *)(input[0] + off + 16 * g));
+        __m128i r1 = _mm_loadu_si128((__m128i *)(input[1] + off + 16 * g));
+        __m128i r2 = _mm_loadu_si128((__m128i *)(input[2] + off + 16 * g));
+        __m128i r3 = _mm_loadu_si128((__m128i *)(input[3] + off + 16 * g));
+
+        __m128i t0 = _mm_unpacklo_epi32(r0, r1);
+        __m128i t1 = _mm_unpacklo_epi32(r2, r3);
+        __m128i t2 = _mm_unpackhi_epi32(r0, r1);
+        __m128i t3 = _mm_unpackhi_epi32(r2, r3);
+
+        x[4 * g + 0] = (v4u32)_mm_unpacklo_epi64(t0, t1);
+        x[4 * g + 1] = (v4u32)_mm_unpackhi_epi64(t0, t1);
+        x[4 * g + 2] = (v4u32)_mm_unpacklo_epi64(t2, t3);
+        x[4 * g + 3] = (v4u32)_mm_unpackhi_epi64(t2, t3);
+    }
+}
+
+/* As LoadX4, with lanes i and i + 4 sharing one 256-bit register. */
+TARGET("avx2")
+static inline void LoadX8(v8u32 x[16], u8 *input[8], u32 off, u32 groups) {
+    for (u32 g = 0; g < groups; g++) {
+        __m256i r[4];
+        for (u32 i = 0; i < 4; i++) {
+            r[i] = _mm256_set_m128i(
+                _mm_loadu_si128((__m128i *)(input[i + 4] + off + 16 * g)),
+                _mm_loadu_si128((__m128i *)(input[i] + off + 16 * g)));
+        }
+
+        __m256i t0 = _mm256_unpacklo_epi32(r[0], r[1]);
+        __m256i t1 = _mm256_unpacklo_epi32(r[2], r[3]);
+        __m256i t2 = _mm256_unpackhi_epi32(r[0], r[1]);
+        __m256i t3 = _mm256_unpackhi_epi32(r[2], r[3]);
+
+        x[4 * g + 0] = (v8u32)_mm256_unpacklo_epi64(t0, t1);
+        x[4 * g + 1] = (v8u32)_mm256_unpackhi_epi64(t0, t1);
+        x[4 * g + 2] = (v8u32)_mm256_unpacklo_epi64(t2, t3);
+        x[4 * g + 3] = (v8u32)_mm256_unpackhi_epi64(t2, t3);
+    }
+}
+
+/* As LoadX4, with lanes i, i + 4, i + 8 and i + 12 sharing one 512-bit
+ * register. */
+TARGET("avx512f")
+static inline void LoadX16(v16u32 x[16], u8 *input[16], u32 off,
+                           u32 groups) {
+    for (u32 g = 0; g < groups; g++) {
+        __m512i r[4];
+        for (u32 i = 0; i < 4; i++) {
+            __m512i v = _mm512_castsi128_si512(
+                _mm_loadu_si128((__m128i *)(input[i] + off + 16 * g)));
+            v = _mm512_inserti32x4(
+                v, _mm_loadu_si128((__m128i *)(input[i + 4] + off + 16 * g)),
+                1);
+            v = _mm512_inserti32x4(
+                v, _mm_loadu_si128((__m128i *)(input[i + 8] + off + 16 * g)),
+                2);
+            v = _mm512_inserti32x4(
+                v,
+                _mm_loadu_si128((__m128i *)(input[i + 12] + off + 16 * g)),
+                3);
+            r[i] = v;
+        }
+
+        __m512i t0 = _mm512_unpacklo_epi32(r[0], r[1]);
+        __m512i t1 = _mm512_unpacklo_epi32(r[2], r[3]);
+        __m512i t2 = _mm512_unpackhi_epi32(r[0], r[1]);
+        __m512i t3 = _mm512_unpackhi_epi32(r[2], r[3]);
+
+        x[4 * g + 0] = (v16u32)_mm512_unpacklo_epi64(t0, t1);
+        x[4 * g + 1] = (v16u32)_mm512_unpackhi_epi64(t0, t1);
+        x[4 * g + 2] = (v16u32)_mm512_unpacklo_epi64(t2, t3);
+        x[4 * g + 3] = (v16u32)_mm512_unpackhi_epi64(t2, t3);
+    }
+}
+#else
+/* Portable loads: decodes message word i of every lane into x[i], for
+ * the first groups groups of four words. */
+#define LOAD_LANES(x, input, off, lanes, groups)                               \
+    for (u32 i = 0; i < 4 * (groups); i++) {                                   \
+        for (u32 l = 0; l < (lanes); l++) {                                    \
+            u8 *p = (input)[l] + (off) + 4 * i;                                \
+            (x)[i][l] = ((u32)p[0]) | (((u32)p[1]) << 8) |                     \
+                        (((u32)p[2]) << 16) | (((u32)p[3]) << 24);             \
+        }                                                                      \
+    }
+static inline void LoadX4(v4u32 x[16], u8 *input[4], u32 off, u32 groups) {
+    LOAD_LANES(x, input, off, 4, groups);
+}
+static inline void LoadX8(v8u32 x[16], u8 *input[8], u32 off, u32 groups) {
+    LOAD_LANES(x, input, off, 8, groups);
+}
+static inline void LoadX16(v16u32 x[16], u8 *input[16], u32 off,
+                           u32 groups) {
+    LOAD_LANES(x, input, off, 16, groups);
+}
+#endif
+
+/* 4-lane MD5 basic transformation. Transforms nblocks consecutive blocks
+ * of input[i] into state[i], for each of the 4 lanes. */
+TARGET("sse2")
+void MD5TransformX4(u32 *state[4], u8 *input[4], u32 nblocks) {
+    v4u32 a, b, c, d, x[16];
+    for (u32 l = 0; l < 4; l++) {
+        a[l] = state[l][0];
+        b[l] = state[l][1];
+        c[l] = state[l][2];
+        d[l] = state[l][3];
+    }
+
+    for (u32 n = 0; n < nblocks; n++) {
+        v4u32 aa = a, bb = b, cc = c, dd = d;
+
+        LoadX4(x, input, 64 * n, 4);
+        MD5_ROUNDS(a, b, c, d, x);
+
+        a += aa;
+        b += bb;
+        c += cc;
+        d += dd;
+    }
+
+    for (u32 l = 0; l < 4; l++) {
+        state[l][0] = a[l];
+        state[l][1] = b[l];
+        state[l][2] = c[l];
+        state[l][3] = d[l];
+    }
+
+    /* Zeroize sensitive information. */
+    memset(x, 0, sizeof(x));
+}
+
+/* 8-lane MD5 basic transformation (AVX2). */
+TARGET("avx2")
+void MD5TransformX8(u32 *state[8], u8 *input[8], u32 nblocks) {
+    v8u32 a, b, c, d, x[16];
+    for (u32 l = 0; l < 8; l++) {
+        a[l] = state[l][0];
+        b[l] = state[l][1];
+        c[l] = state[l][2];
+        d[l] = state[l][3];
+    }
+
+    for (u32 n = 0; n < nblocks; n++) {
+        v8u32 aa = a, bb = b, cc = c, dd = d;
+
+        LoadX8(x, input, 64 * n, 4);
+        MD5_ROUNDS(a, b, c, d, x);
+
+        a += aa;
+        b += bb;
+        c += cc;
+        d += dd;
+    }
+
+    for (u32 l = 0; l < 8; l++) {
+        state[l][0] = a[l];
+        state[l][1] = b[l];
+        state[l][2] = c[l];
+        state[l][3] = d[l];
+    }
+
+    /* Zeroize sensitive information. */
+    memset(x, 0, sizeof(x));
+}
+
+/* 16-lane MD5 basic transformation (AVX-512). */
+TARGET("avx512f")
+void MD5TransformX16(u32 *state[16], u8 *input[16], u32 nblocks) {
+    v16u32 a, b, c, d, x[16];
+    for (u32 l = 0; l < 16; l++) {
+        a[l] = state[l][0];
+        b[l] = state[l][1];
+        c[l] = state[l][2];
+        d[l] = state[l][3];
+    }
+
+    for (u32 n = 0; n < nblocks; n++) {
+        v16u32 aa = a, bb = b, cc = c, dd = d;
+
+        LoadX16(x, input, 64 * n, 4);
+        MD5_ROUNDS(a, b, c, d, x);
+
+        a += aa;
+        b += bb;
+        c += cc;
+        d += dd;
+    }
+
+    for (u32 l = 0; l < 16; l++) {
+        state[l][0] = a[l];
+        state[l][1] = b[l];
+        state[l][2] = c[l];
+        state[l][3] = d[l];
+    }
+
+    /* Zeroize sensitive information. */
+    memset(x, 0, sizeof(x));
+}
+
+/* FIXED_LANES digests lanes consecutive len-byte records into digests,
+ * one record per lane, with T the vector type and Load the transposed
+ * loader of that width. len is 16, 32 or 64 and a constant in every
+ * expansion, so the padding words fold into the round additions. */
+#define FIXED_LANES(T, lanes, Load, records, len, digests)                    \
+    {                                                                          \
+        u8 *input[lanes];                                                      \
+        for (u32 l = 0; l < (lanes); l++) {                                    \
+            input[l] = (u8 *)(records) + (size_t)l * (len);                    \
+        }                                                                      \
+                                                                               \
+        T zero = {0}, x[16];                                                   \
+        Load(x, input, 0, (len) / 16);                                         \
+        if ((len) < 64) {                                                      \
+            MD5_PAD_WORDS(x, (len) / 4, 8 * (len), zero);                      \
+        }                                                                      \
+                                                                               \
+        T a = zero + 0x67452301, b = zero + 0xefcdab89;                        \
+        T c = zero + 0x98badcfe, d = zero + 0x10325476;                        \
+        MD5_ROUNDS(a, b, c, d, x);                                             \
+        a += 0x67452301;                                                       \
+        b += 0xefcdab89;                                                       \
+        c += 0x98badcfe;                                                       \
+        d += 0x10325476;                                                       \
+                                                                               \
+        if ((len) == 64) {                                                     \
+            T aa = a, bb = b, cc = c, dd = d;                                  \
+            MD5_PAD_WORDS(x, 0, 512, zero);                                    \
+            MD5_ROUNDS(a, b, c, d, x);                                         \
+            a += aa;                                                           \
+            b += bb;                                                           \
+            c += cc;                                                           \
+            d += dd;                                                           \
+        }                                                                      \
+                                                                               \
+        for (u32 l = 0; l < (lanes); l++) {                                    \
+            u32 state[4] = {a[l], b[l], c[l], d[l]};                           \
+            for (u32 i = 0; i < 16; i++) {                                     \
+                (digests)[l][i] = (u8)(state[i / 4] >> (8 * (i % 4)));         \
+            }                                                                  \
+        }                                                                      \
+                                                                               \
+        /* Zeroize sensitive information. */                                   \
+        memset(x, 0, sizeof(x));                                               \
+    }
+
+/* Fixed-length batch message-digest operations. Digest n consecutive
+ * 16-, 32- or 64-byte records into digests[0..n-1], as many records at a
+ * time as there are lanes. */
+void MD5Fixed16N(const u8 *records, size_t n, u8 (*digests)[16]) {
+    FixedN(records, 16, n, digests);
+}
+
+void MD5Fixed32N(const u8 *records, size_t n, u8 (*digests)[16]) {
+    FixedN(records, 32, n, digests);
+}
+
+void MD5Fixed64N(const u8 *records, size_t n, u8 (*digests)[16]) {
+    FixedN(records, 64, n, digests);
+}
+
+/* Multi-buffer block update operation. Continues n independent MD5
+ * message-digest operations, absorbing inputLen[i] bytes of input[i]
+ * into context[i]. Whole blocks are transformed in groups of lanes; the
+ * partial blocks on either side go through MD5Update. */
+void MD5UpdateLanes(MD5_CTX *context[], u8 *input[], u32 inputLen[], u32 n) {
+    u32 maxLanes = MD5MaxLanes();
+
+    for (u32 first = 0; first < n;) {
+        u32 rest = n - first;
+
+        /* Widest supported kernel for the lanes left; a group of a
+         * single lane is not worth a vector pass. Unlike MD5Batch, which
+         * refills lanes, a group never runs wider than its messages
+         * unless fewer than four are left. */
+        u32 lanes = 16;
+        while (lanes > 4 && (lanes > maxLanes || lanes > rest)) {
+            lanes /= 2;
+        }
+        u32 used = (rest < lanes) ? rest : lanes;
+
+        /* Complete any partially filled buffer, so that every lane
+         * continues at a block boundary. */
+        u32 offset[16];
+        u32 nblocks = 0xffffffff;
+        for (u32 l = 0; l < used; l++) {
+            MD5_CTX *ctx = context[first + l];
+            u32 len = inputLen[first + l];
+            u32 index = (u32)((ctx->count >> 3) & 0x3F);
+
+            if (index == 0) {
+                offset[l] = 0;
+            } else if (len >= 64 - index) {
+                offset[l] = 64 - index;
+                MD5Update(ctx, input[first + l], offset[l]);
+            } else {
+                offset[l] = len;
+                MD5Update(ctx, input[first + l], len);
+            }
+
+            u32 blocks = (len - offset[l]) / 64;
+            if (blocks < nblocks) {
+                nblocks = blocks;
+            }
+        }
+
+        /* Run the whole blocks common to all lanes. Unused lanes repeat
+         * the first one into a scratch state. */
+        if (used > 1 && nblocks > 0) {
+            u32 scratch[4] = {0};
+            u32 *state[16];
+            u8 *data[16];
+            for (u32 l = 0; l < lanes; l++) {
+                if (l < used) {
+                    state[l] = context[first + l]->state;
+                    data[l] = input[first + l] + offset[l];
+                } else {
+                    state[l] = scratch;
+                    data[l] = data[0];
+                }
+            }
+
+            TransformLanes(lanes, state, data, nblocks);
+
+            for (u32 l = 0; l < used; l++) {
+                MD5Count(context[first + l], 64 * nblocks);
+                offset[l] += 64 * nblocks;
+            }
+            MD5_COUNT(bytes, (u64)64 * nblocks * used);
+        }
+
+        /* Remaining blocks and buffered tail of each lane */
+        for (u32 l = 0; l < used; l++) {
+            MD5Update(context[first + l], input[first + l] + offset[l],
+                      inputLen[first + l] - offset[l]);
+        }
+
+        first += used;
+    }
+}
+
+/* Adds len bytes, already transformed into the state, to the bit count
+ * of context. */
+static void MD5Count(MD5_CTX *context, u32 len) {
+    context->count += (u64)len << 3;
+}
+
+/* Narrowest kernel that covers n messages, capped at maxLanes, for
+ * MD5Batch. Fewer than four messages still use the 4-lane kernel. */
+static u32 LaneWidth(u32 maxLanes, u64 n) {
+    u32 lanes = 4;
+    while (lanes < maxLanes && lanes < n) {
+        lanes *= 2;
+    }
+    return lanes;
+}
+
+/* Runs the kernel of the given width. */
+static void TransformLanes(u32 lanes, u32 *state[], u8 *input[],
+                           u32 nblocks) {
+    MD5_COUNT(laneBlocks, (u64)lanes * nblocks);
+    switch (lanes) {
+    case 16: MD5TransformX16(state, input, nblocks); break;
+    case 8: MD5TransformX8(state, input, nblocks); break;
+    default: MD5TransformX4(state, input, nblocks); break;
+    }
+}
+
+/* A message waiting for, or running in, a batch lane. */
+typedef struct {
+    u64 blocks; /* number of blocks including padding */
+    size_t index;
+} MD5_JOB;
+
+/* One lane of MD5Batch. Data blocks come straight from the message; the
+ * last one or two blocks are the padded tail, built in tail. */
+typedef struct {
+    size_t index;  /* message in this lane */
+    const u8 *ptr; /* next block */
+    u64 dataLeft;  /* whole message blocks left at ptr; 0 once in tail */
+    u32 tailLeft;  /* padded tail blocks left */
+    u32 state[4];
+    u8 tail[128];
+} MD5_LANE;
+
+/* Batch message-digest operation. Digests n independent messages,
+ * inputs[i] of lens[i] bytes, into digests[i].
+ *
+ * Messages are scheduled longest first, so lanes run messages of similar
+ * block count side by side. Whenever a message completes, its digest is
+ * written and the next message takes over the lane; padding blocks run
+ * in the lanes like any other block. */
+void MD5Batch(const u8 **inputs, const u64 *lens, u8 (*digests)[16],
+              size_t n) {
+    if (n == 0) {
+        return;
+    }
+
+    /* Schedule by descending block count, unless the messages come in
+     * that order already, as same-sized records do. Without memory for
+     * the schedule, messages run in argument order. */
+    size_t ordered = 1;
+    while (ordered < n &&
+           (lens[ordered] + 8) / 64 <= (lens[ordered - 1] + 8) / 64) {
+        ordered++;
+    }
+    MD5_JOB *jobs = (ordered < n) ? malloc(n * sizeof(*jobs)) : NULL;
+    if (jobs != NULL) {
+        for (size_t i = 0; i < n; i++) {
+            jobs[i].blocks = (lens[i] + 8) / 64 + 1;
+            jobs[i].index = i;
+        }
+        qsort(jobs, n, sizeof(*jobs), CompareBlocks);
+    }
+
+    u32 lanes = LaneWidth(MD5MaxLanes(), n);
+    MD5_LANE lane[16];
+    u32 active = 0;
+    size_t next = 0;
+
+    u32 scratch[4] = {0};
+
+    for (u32 l = 0; l < lanes; l++) {
+        lane[l].ptr = NULL;
+    }
+
+    for (;;) {
+        /* Refill empty lanes */
+        for (u32 l = 0; l < lanes && next < n; l++) {
+            if (lane[l].ptr != NULL) {
+                continue;
+            }
+
+            MD5_LANE *ln = &lane[l];
+            ln->index = (jobs != NULL) ? jobs[next].index : next;
+            next++;
+
+            u64 len = lens[ln->index];
+            MD5_COUNT(bytes, len);
+            u32 rest = (u32)(len & 0x3F);
+            ln->ptr = inputs[ln->index];
+            ln->dataLeft = len / 64;
+            ln->tailLeft = (rest < 56) ? 1 : 2;
+
+            if (rest > 0) {
+                memcpy(ln->tail, inputs[ln->index] + (len - rest), rest);
+            }
+            ln->tail[rest] = 0x80;
+            memset(ln->tail + rest + 1, 0, 64 * ln->tailLeft - 9 - rest);
+            u64 bits = len << 3;
+            for (u32 i = 0; i < 8; i++) {
+                ln->tail[64 * ln->tailLeft - 8 + i] = (u8)(bits >> (8 * i));
+            }
+
+            if (ln->dataLeft == 0) {
+                ln->ptr = ln->tail;
+            }
+
+            ln->state[0] = 0x67452301;
+            ln->state[1] = 0xefcdab89;
+            ln->state[2] = 0x98badcfe;
+            ln->state[3] = 0x10325476;
+            active++;
+        }
+
+        if (active == 0) {
+            break;
+        }
+
+        /* Run as many blocks as every active lane has contiguously */
+        u64 nblocks = 1 << 20;
+        u32 *state[16];
+        u8 *data[16];
+        u8 *busy = NULL;
+        for (u32 l = 0; l < lanes; l++) {
+            MD5_LANE *ln = &lane[l];
+            if (ln->ptr == NULL) {
+                continue;
+            }
+
+            u64 left = (ln->dataLeft == 0) ? ln->tailLeft : ln->dataLeft;
+            if (left < nblocks) {
+                nblocks = left;
+            }
+            busy = (u8 *)ln->ptr;
+        }
+
+        /* Idle lanes shadow a busy one into a scratch state */
+        for (u32 l = 0; l < lanes; l++) {
+            MD5_LANE *ln = &lane[l];
+            state[l] = (ln->ptr != NULL) ? ln->state : scratch;
+            data[l] = (ln->ptr != NULL) ? (u8 *)ln->ptr : busy;
+        }
+
+        u32 step = (u32)nblocks;
+        TransformLanes(lanes, state, data, step);
+
+        /* Advance, and retire finished messages */
+        for (u32 l = 0; l < lanes; l++) {
+            MD5_LANE *ln = &lane[l];
+            if (ln->ptr == NULL) {
+                continue;
+            }
+
+            if (ln->dataLeft == 0) {
+                ln->tailLeft -= step;
+                ln->ptr += 64 * step;
+                if (ln->tailLeft > 0) {
+                    continue;
+                }
+
+                for (u32 i = 0; i < 16; i++) {
+                    digests[ln->index][i] =
+                        (u8)(ln->state[i / 4] >> (8 * (i % 4)));
+                }
+                ln->ptr = NULL;
+                active--;
+            } else {
+                ln->dataLeft -= step;
+                ln->ptr = (ln->dataLeft > 0) ? ln->ptr + 64 * step : ln->tail;
+            }
+        }
+    }
+
+    /* Zeroize sensitive information. */
+    memset(lane, 0, sizeof(lane));
+    free(jobs);
+}
+
+/* Chunked message-digest operation. Splits the len bytes at input into
+ * parts of partLen bytes (the last one may be shorter; an empty input is
+ * one empty part) and digests part i into digests[i], several parts at
+ * a time in SIMD lanes. Returns the number of parts. */
+u64 MD5Parts(const u8 *input, u64 len, u64 partLen, u8 (*digests)[16]) {
+    u64 parts = (len == 0) ? 1 : (len - 1) / partLen + 1;
+
+    /* Same-length parts keep every lane busy; the short last part joins
+     * the final group. */
+    const u8 *inputs[64];
+    u64 lens[64];
+    for (u64 first = 0; first < parts; first += 64) {
+        u64 count = (parts - first < 64) ? parts - first : 64;
+        for (u64 i = 0; i < count; i++) {
+            u64 offset = (first + i) * partLen;
+            inputs[i] = input + offset;
+            lens[i] = (len - offset < partLen) ? len - offset : partLen;
+        }
+        MD5Batch(inputs, lens, digests + first, count);
+    }
+    return parts;
+}
+
+/* Multipart digest, as used for S3 multipart ETags: the digest of the
+ * concatenated digests of the parts. The part digests go straight
+ * through the transform, padded here as in MD5Batch, so that they don't
+ * count as input bytes in the statistics. */
+void MD5Multipart(u8 digest[16], u8 (*parts)[16], u64 n) {
+    u32 state[4] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476};
+    u8 *input = (u8 *)parts;
+    u64 len = 16 * n;
+
+    /* MD5TransformBlocks takes a 32-bit block count. */
+    for (u64 nblocks = len / 64; nblocks > 0;) {
+        u32 step = (nblocks < 0x1000000) ? (u32)nblocks : 0x1000000;
+        MD5TransformBlocks(state, input, step);
+        input += (u64)64 * step;
+        nblocks -= step;
+    }
+
+    u8 tail[128];
+    u32 rest = (u32)(len & 0x3F);
+    u32 tailBlocks = (rest < 56) ? 1 : 2;
+    memcpy(tail, input, rest);
+    tail[rest] = 0x80;
+    memset(tail + rest + 1, 0, 64 * tailBlocks - 9 - rest);
+    u64 bits = len << 3;
+    for (u32 i = 0; i < 8; i++) {
+        tail[64 * tailBlocks - 8 + i] = (u8)(bits >> (8 * i));
+    }
+    MD5TransformBlocks(state, tail, tailBlocks);
+
+    for (u32 i = 0; i < 16; i++) {
+        digest[i] = (u8)(state[i / 4] >> (8 * (i % 4)));
+    }
+}
+
+/* Runs the widest kernels that fill their lanes over n len-byte
+ * records, and the scalar code over the last few. */
+static void FixedN(const u8 *records, u32 len, size_t n,
+                   u8 (*digests)[16]) {
+    for (u32 lanes = MD5MaxLanes(); lanes >= 4; lanes /= 2) {
+        for (; n >= lanes; n -= lanes) {
+            switch (lanes) {
+            case 16: FixedX16(records, len, digests); break;
+            case 8: FixedX8(records, len, digests); break;
+            default: FixedX4(records, len, digests); break;
+            }
+            records += (size_t)lanes * len;
+            digests += lanes;
+        }
+    }
+
+    for (; n > 0; n--, records += len, digests++) {
+        switch (len) {
+        case 16: MD5Fixed16(records, *digests); break;
+        case 32: MD5Fixed32(records, *digests); break;
+        default: MD5Fixed64(records, *digests); break;
+        }
+    }
+}
+
+/* Digest 4, 8 or 16 len-byte records, one per lane. */
+TARGET("sse2")
+static void FixedX4(const u8 *records, u32 len, u8 (*digests)[16]) {
+    switch (len) {
+    case 16: FIXED_LANES(v4u32, 4, LoadX4, records, 16, digests); break;
+    case 32: FIXED_LANES(v4u32, 4, LoadX4, records, 32, digests); break;
+    default: FIXED_LANES(v4u32, 4, LoadX4, records, 64, digests); break;
+    }
+}
+
+TARGET("avx2")
+static void FixedX8(const u8 *records, u32 len, u8 (*digests)[16]) {
+    switch (len) {
+    case 16: FIXED_LANES(v8u32, 8, LoadX8, records, 16, digests); break;
+    case 32: FIXED_LANES(v8u32, 8, LoadX8, records, 32, digests); break;
+    default: FIXED_LANES(v8u32, 8, LoadX8, records, 64, digests); break;
+    }
+}
+
+TARGET("avx512f")
+static void FixedX16(const u8 *records, u32 len, u8 (*digests)[16]) {
+    switch (len) {
+    case 16: FIXED_LANES(v16u32, 16, LoadX16, records, 16, digests); break;
+    case 32: FIXED_LANES(v16u32, 16, LoadX16, records, 32, digests); break;
+    default: FIXED_LANES(v16u32, 16, LoadX16, records, 64, digests); break;
+    }
+}
+
+/* Orders MD5_JOBs by descending block count. */
+static int CompareBlocks(const void *a, const void *b) {
+    u64 x = ((const MD5_JOB *)a)->blocks, y = ((const MD5_JOB *)b)->blocks;
+    return (x < y) - (x > y);
+}
@@ -0,0 +1,324 @@
+/* MDBENCH.C - benchmark harness for the MD driver */
+
+/* Every API is timed on every kernel that drives it, over message sizes
+ * 0, 1, 4, 16, ... bytes up to a maximum. A measurement first doubles
+ * its iteration count until one sample takes SAMPLE_NS, which also
+ * warms up caches and branch predictors, then takes samples until
+ * MEASURE_NS have passed (at least MIN_SAMPLES, at most MAX_SAMPLES).
+ * Results are the median and percentiles of the time per hash, with
+ * throughput and, on x86, time stamp counter cycles per byte. */
+
+#include "global.h"
+#include "md5.h"
+#include "mdbench.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define MD_BENCH_TSC
+#endif
+
+#define SAMPLE_NS 2e6
+#define MEASURE_NS 1e8
+#define MIN_SAMPLES 3
+#define MAX_SAMPLES 31
+
+/* Update length of the streaming API, and messages per MD5Batch call. */
+#define STREAM_LEN 4096
+#define BATCH_MESSAGES 64
+#define BATCH_LARGE_MESSAGES 16
+#define BATCH_LARGE_LEN (1 << 20)
+
+/* The APIs under test. Lane APIs run on the multi-buffer kernels, the
+ * others on the single-stream kernels. */
+typedef enum {
+    API_ONESHOT, /* MD5Init, one MD5Update, MD5Final */
+    API_STREAM,  /* MD5Update in STREAM_LEN pieces */
+    API_SHORT,   /* MD5Short, up to 255 bytes */
+    API_FIXED,   /* MD5Fixed16/32/64 */
+    API_BATCH,   /* MD5Batch */
+    API_FIXEDN,  /* MD5Fixed16N/32N/64N */
+    APIS
+} MD_API;
+
+static const char *apiNames[APIS] = {"oneshot", "stream", "short",
+                                     "fixed",   "batch",  "fixedN"};
+
+/* One measurement. */
+typedef struct {
+    MD_API api;
+    const char *kernel;
+    u8 *data;
+    u64 len;
+    u64 hashes; /* per iteration */
+    u64 iterations;
+    u32 samples;
+    double ns[MAX_SAMPLES];  /* per hash, sorted */
+    double tsc[MAX_SAMPLES]; /* per hash, in sample order */
+} MD_BENCH;
+
+static volatile u8 sink;
+
+static i32 ApiSupports(MD_API, u64);
+static i32 IsLaneApi(MD_API);
+static void Measure(MD_BENCH *);
+static double Sample(MD_BENCH *, u64, double *);
+static void Run(MD_BENCH *);
+static double Percentile(double *, u32, u32);
+static double Median(double *, u32);
+static void Report(MD_BENCH *, i32, i32);
+static double Now(void);
+static u64 Ticks(void);
+static i32 CompareDoubles(const void *, const void *);
+
+/* Runs the benchmarks on messages of up to maxLen bytes and prints the
+ * results as a table, or as JSON if json is set. The active kernels are
+ * restored afterwards. */
+void MDBench(u64 maxLen, i32 json) {
+    u8 *data = malloc(maxLen ? maxLen : 1);
+    if (data == NULL) {
+        printf("%llu bytes can't be allocated\n", (unsigned long long)maxLen);
+        return;
+    }
+    for (u64 i = 0; i < maxLen; i++) {
+        data[i] = (u8)(i & 0xff);
+    }
+
+    const char *transform = MD5Kernel();
+    const char *lanes = MD5LaneKernel();
+
+    if (json) {
+        printf("{\"benchmark\": \"md5\", \"tsc\": %s, \"results\": [",
+#ifdef MD_BENCH_TSC
+               "true"
+#else
+               "false"
+#endif
+        );
+    } else {
+        printf("MD5 benchmark, messages of 0 to %llu bytes\n",
+               (unsigned long long)maxLen);
+        printf("%-8s %-7s %10s %12s %12s %12s %10s %8s\n", "api", "kernel",
+               "bytes", "ns/hash", "p10", "p90", "MB/s", "cyc/B");
+    }
+
+    i32 first = 1;
+    for (MD_API api = 0; api < APIS; api++) {
+        const char *kernel;
+        for (u32 k = 0; (kernel = MD5KernelName(k)) != NULL; k++) {
+            if ((MD5KernelLanes(kernel) != 0) != IsLaneApi(api)) {
+                continue;
+            }
+            MD5SetKernel(kernel);
+
+            for (u64 len = 0; len <= maxLen; len = len ? 4 * len : 1) {
+                if (!ApiSupports(api, len)) {
+                    continue;
+                }
+
+                MD_BENCH bench;
+                bench.api = api;
+                bench.kernel = kernel;
+                bench.data = data;
+                bench.len = len;
+                bench.hashes = 1;
+                if (api == API_BATCH || api == API_FIXEDN) {
+                    bench.hashes = (len <= BATCH_LARGE_LEN)
+                                       ? BATCH_MESSAGES
+                                       : BATCH_LARGE_MESSAGES;
+                }
+                if (api == API_FIXEDN && bench.hashes * len > maxLen) {
+                    continue;
+                }
+
+                Measure(&bench);
+                Report(&bench, json, first);
+                first = 0;
+                fflush(stdout);
+            }
+        }
+    }
+
+    if (json) {
+        printf("\n]}\n");
+    }
+
+    MD5SetKernel(transform);
+    MD5SetKernel(lanes);
+    free(data);
+}
+
+/* Returns whether api takes len-byte messages. */
+static i32 ApiSupports(MD_API api, u64 len) {
+    switch (api) {
+    case API_SHORT: return len <= 255;
+    case API_FIXED:
+    case API_FIXEDN: return len == 16 || len == 32 || len == 64;
+    default: return len <= 0xffffffff;
+    }
+}
+
+/* Returns whether api runs on the multi-buffer kernels. */
+static i32 IsLaneApi(MD_API api) {
+    return api == API_BATCH || api == API_FIXEDN;
+}
+
+/* Calibrates bench, then takes its samples. */
+static void Measure(MD_BENCH *bench) {
+    double ticks;
+    bench->iterations = 1;
+    while (Sample(bench, bench->iterations, &ticks) < SAMPLE_NS &&
+           bench->iterations < ((u64)1 << 40)) {
+        bench->iterations *= 2;
+    }
+
+    double total = 0;
+    u64 hashes = bench->iterations * bench->hashes;
+    for (bench->samples = 0;
+         bench->samples < MAX_SAMPLES &&
+         (bench->samples < MIN_SAMPLES || total < MEASURE_NS);
+         bench->samples++) {
+        double ns = Sample(bench, bench->iterations, &ticks);
+        total += ns;
+        bench->ns[bench->samples] = ns / hashes;
+        bench->tsc[bench->samples] = ticks / hashes;
+    }
+}
+
+/* Runs iterations iterations of bench. Returns the time taken in
+ * nanoseconds, and the time stamp counter ticks in ticks. */
+static double Sample(MD_BENCH *bench, u64 iterations, double *ticks) {
+    double start = Now();
+    u64 tsc = Ticks();
+    for (u64 i = 0; i < iterations; i++) {
+        Run(bench);
+    }
+    *ticks = (double)(Ticks() - tsc);
+    return Now() - start;
+}
+
+/* Runs one iteration of bench. */
+static void Run(MD_BENCH *bench) {
+    u8 *data = bench->data;
+    u32 len = (u32)bench->len;
+    u8 digest[BATCH_MESSAGES][16];
+    MD5_CTX context;
+
+    switch (bench->api) {
+    case API_ONESHOT:
+        MD5Init(&context);
+        MD5Update(&context, data, len);
+        MD5Final(digest[0], &context);
+        break;
+    case API_STREAM:
+        MD5Init(&context);
+        for (u32 off = 0; off < len; off += STREAM_LEN) {
+            MD5Update(&context, data + off,
+                      (len - off < STREAM_LEN) ? len - off : STREAM_LEN);
+        }
+        MD5Final(digest[0], &context);
+        break;
+    case API_SHORT: MD5Short(data, (u8)len, digest[0]); break;
+    case API_FIXED:
+        switch (len) {
+        case 16: MD5Fixed16(data, digest[0]); break;
+        case 32: MD5Fixed32(data, digest[0]); break;
+        default: MD5Fixed64(data, digest[0]); break;
+        }
+        break;
+    case API_BATCH: {
+        /* Every message reads the same data. */
+        const u8 *inputs[BATCH_MESSAGES];
+        u64 lens[BATCH_MESSAGES];
+        for (u32 i = 0; i < bench->hashes; i++) {
+            inputs[i] = data;
+            lens[i] = len;
+        }
+        MD5Batch(inputs, lens, digest, bench->hashes);
+        break;
+    }
+    case API_FIXEDN:
+        switch (len) {
+        case 16: MD5Fixed16N(data, bench->hashes, digest); break;
+        case 32: MD5Fixed32N(data, bench->hashes, digest); break;
+        default: MD5Fixed64N(data, bench->hashes, digest); break;
+        }
+        break;
+    default: break;
+    }
+
+    sink ^= digest[0][0];
+}
+
+/* Returns the p-th percentile of the n sorted values, by nearest
+ * rank. */
+static double Percentile(double *sorted, u32 n, u32 p) {
+    return sorted[(u64)(n - 1) * p / 100];
+}
+
+/* Returns the median of n values, sorting them. */
+static double Median(double *values, u32 n) {
+    qsort(values, n, sizeof(*values), CompareDoubles);
+    return (n % 2) ? values[n / 2] : (values[n / 2 - 1] + values[n / 2]) / 2;
+}
+
+/* Prints the results of bench as a table row, or as a JSON object
+ * following first or later ones. */
+static void Report(MD_BENCH *bench, i32 json, i32 first) {
+    u32 n = bench->samples;
+    double ns = Median(bench->ns, n);
+    double p10 = Percentile(bench->ns, n, 10);
+    double p90 = Percentile(bench->ns, n, 90);
+    double min = bench->ns[0];
+    double mbs = (ns > 0) ? bench->len * 1e3 / ns : 0;
+    double cpb = (bench->len > 0) ? Median(bench->tsc, n) / bench->len : 0;
+#ifndef MD_BENCH_TSC
+    cpb = 0;
+#endif
+
+    if (!json) {
+        printf("%-8s %-7s %10llu %12.1f %12.1f %12.1f %10.1f %8.2f\n",
+               apiNames[bench->api], bench->kernel,
+               (unsigned long long)bench->len, ns, p10, p90, mbs, cpb);
+        return;
+    }
+
+    printf("%s\n  {\"api\": \"%s\", \"kernel\": \"%s\", \"bytes\": %llu, "
+           "\"hashes\": %llu, \"samples\": %u, "
+           "\"ns_per_hash\": {\"median\": %.3f, \"p10\": %.3f, "
+           "\"p90\": %.3f, \"min\": %.3f}, \"mb_per_s\": %.3f, ",
+           first ? "" : ",", apiNames[bench->api], bench->kernel,
+           (unsigned long long)bench->len,
+           (unsigned long long)(bench->iterations * bench->hashes * n), n, ns,
+           p10, p90, min, mbs);
+    if (cpb > 0) {
+        printf("\"cycles_per_byte\": %.4f}", cpb);
+    } else {
+        printf("\"cycles_per_byte\": null}");
+    }
+}
+
+/* Returns a monotonic time in nanoseconds. */
+static double Now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Returns the time stamp counter, or 0 where there is none. */
+static u64 Ticks(void) {
+#ifdef MD_BENCH_TSC
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+/* Orders doubles ascending. */
+static i32 CompareDoubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
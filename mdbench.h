@@ -0,0 +1,3 @@
+/* MDBENCH.H - header file for MDBENCH.C */
+
+void MDBench(u64, i32);
@@ -0,0 +1,243 @@
+/* MDCACHE.C - persistent digest cache for the MD driver */
+
+/* The cache maps (device, inode) to the size, mtime and ctime a file had
+ * when it was digested, and its digest. A file whose metadata still
+ * matches is not read again.
+ *
+ * File format, in host byte order so that it can be used in place
+ * through a read-only mapping:
+ *   header  - magic "MD5CACHE", u32 version, u32 byte order mark
+ *             (0x01020304), u64 entry count
+ *   entries - MD_CACHE_ENTRY[count], sorted by (dev, ino)
+ * A cache with another version or byte order is ignored and rewritten.
+ *
+ * Lookups binary-search the mapping. Entries stored during the run are
+ * kept in memory and merged in by MDCacheSave, replacing older entries
+ * of the same file; entries of files not seen again are kept. */
+
+#include "global.h"
+#include "mdcache.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MD_CACHE_VERSION 1
+#define MD_CACHE_BOM 0x01020304
+
+typedef struct {
+    u8 magic[8];
+    u32 version;
+    u32 bom;
+    u64 count;
+} MD_CACHE_HEADER;
+
+typedef struct {
+    u64 dev;
+    u64 ino;
+    u64 size;
+    i64 mtime; /* nanoseconds */
+    i64 ctime; /* nanoseconds */
+    u8 digest[16];
+} MD_CACHE_ENTRY;
+
+static char *cachePath = NULL;
+static u8 *map = NULL;
+static size_t mapLen = 0;
+static const MD_CACHE_ENTRY *entry = NULL; /* in map */
+static u64 entries = 0;
+
+static i64 openTime = 0; /* nanoseconds */
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static MD_CACHE_ENTRY *added = NULL; /* stored during this run */
+static u64 addedCount = 0;
+static u64 addedSize = 0;
+
+static void MDCacheKey(MD_CACHE_ENTRY *, const struct stat *);
+static i32 CompareEntries(const void *, const void *);
+
+/* Opens the cache at path, mapping it if it exists and is valid. A
+ * missing or invalid cache starts out empty. Returns -1 if a cache is
+ * already open, or there is no memory for its path. */
+i32 MDCacheOpen(const char *path) {
+    if (cachePath != NULL || (cachePath = strdup(path)) == NULL) {
+        return -1;
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    openTime = (i64)now.tv_sec * 1000000000 + now.tv_nsec;
+
+    i32 fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return 0;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && (u64)st.st_size >= sizeof(MD_CACHE_HEADER)) {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) {
+            map = NULL;
+        } else {
+            mapLen = st.st_size;
+        }
+    }
+    close(fd);
+
+    if (map != NULL) {
+        const MD_CACHE_HEADER *header = (const MD_CACHE_HEADER *)map;
+        u64 room = (mapLen - sizeof(*header)) / sizeof(MD_CACHE_ENTRY);
+        if (memcmp(header->magic, "MD5CACHE", 8) == 0 &&
+            header->version == MD_CACHE_VERSION &&
+            header->bom == MD_CACHE_BOM && header->count <= room) {
+            entry = (const MD_CACHE_ENTRY *)(header + 1);
+            entries = header->count;
+        }
+    }
+    return 0;
+}
+
+/* Looks up the file described by st. Returns 1 and its cached digest if
+ * the cached metadata matches st, and 0 otherwise. */
+i32 MDCacheLookup(const struct stat *st, u8 digest[16]) {
+    if (entries == 0) {
+        return 0;
+    }
+
+    MD_CACHE_ENTRY key;
+    MDCacheKey(&key, st);
+
+    const MD_CACHE_ENTRY *found =
+        bsearch(&key, entry, entries, sizeof(*entry), CompareEntries);
+    if (found == NULL || found->size != key.size ||
+        found->mtime != key.mtime || found->ctime != key.ctime) {
+        return 0;
+    }
+
+    memcpy(digest, found->digest, 16);
+    return 1;
+}
+
+/* Records digest for the file described by st. Files changed since the
+ * cache was opened are not recorded, as they may change again without
+ * their timestamps moving. Safe to call from several threads. */
+void MDCacheStore(const struct stat *st, u8 digest[16]) {
+    MD_CACHE_ENTRY key;
+    MDCacheKey(&key, st);
+    if (cachePath == NULL || key.mtime >= openTime || key.ctime >= openTime) {
+        return;
+    }
+
+    pthread_mutex_lock(&lock);
+    if (addedCount == addedSize) {
+        u64 size = addedSize ? 2 * addedSize : 1024;
+        MD_CACHE_ENTRY *grown = realloc(added, size * sizeof(*added));
+        if (grown == NULL) {
+            pthread_mutex_unlock(&lock);
+            return;
+        }
+        added = grown;
+        addedSize = size;
+    }
+    MD_CACHE_ENTRY *e = &added[addedCount++];
+    *e = key;
+    memcpy(e->digest, digest, 16);
+    pthread_mutex_unlock(&lock);
+}
+
+/* Writes the cache back, merging the entries stored during this run.
+ * The new cache replaces the old one atomically. Returns -1 on
+ * failure. */
+i32 MDCacheSave(void) {
+    if (cachePath == NULL || addedCount == 0) {
+        return 0;
+    }
+
+    /* A file stored twice (a hard link, or a file named twice) keeps
+     * one entry. */
+    qsort(added, addedCount, sizeof(*added), CompareEntries);
+    u64 unique = 0;
+    for (u64 i = 0; i < addedCount; i++) {
+        if (unique == 0 ||
+            CompareEntries(&added[unique - 1], &added[i]) != 0) {
+            added[unique++] = added[i];
+        }
+    }
+
+    size_t tmpLen = strlen(cachePath) + 5;
+    char *tmp = malloc(tmpLen);
+    if (tmp == NULL) {
+        return -1;
+    }
+    snprintf(tmp, tmpLen, "%s.tmp", cachePath);
+
+    FILE *file = fopen(tmp, "wb");
+    if (file == NULL) {
+        free(tmp);
+        return -1;
+    }
+
+    MD_CACHE_HEADER header;
+    memcpy(header.magic, "MD5CACHE", 8);
+    header.version = MD_CACHE_VERSION;
+    header.bom = MD_CACHE_BOM;
+    header.count = 0;
+    fwrite(&header, sizeof(header), 1, file);
+
+    /* Merge the two sorted lists; on equal keys the new entry wins. */
+    u64 i = 0, j = 0;
+    while (i < entries || j < unique) {
+        const MD_CACHE_ENTRY *e;
+        if (j == unique) {
+            e = &entry[i++];
+        } else if (i == entries) {
+            e = &added[j++];
+        } else {
+            i32 order = CompareEntries(&entry[i], &added[j]);
+            if (order < 0) {
+                e = &entry[i++];
+            } else {
+                i += (order == 0);
+                e = &added[j++];
+            }
+        }
+        fwrite(e, sizeof(*e), 1, file);
+        header.count++;
+    }
+
+    fseek(file, 0, SEEK_SET);
+    fwrite(&header, sizeof(header), 1, file);
+    i32 status = (ferror(file) || fclose(file) != 0) ? -1 : 0;
+    if (status == 0) {
+        status = rename(tmp, cachePath);
+    } else {
+        remove(tmp);
+    }
+    free(tmp);
+    return status;
+}
+
+/* Fills the key and metadata of e from st. */
+static void MDCacheKey(MD_CACHE_ENTRY *e, const struct stat *st) {
+    memset(e, 0, sizeof(*e));
+    e->dev = st->st_dev;
+    e->ino = st->st_ino;
+    e->size = st->st_size;
+    e->mtime = (i64)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+    e->ctime = (i64)st->st_ctim.tv_sec * 1000000000 + st->st_ctim.tv_nsec;
+}
+
+/* Orders MD_CACHE_ENTRYs by (dev, ino). */
+static i32 CompareEntries(const void *a, const void *b) {
+    const MD_CACHE_ENTRY *x = a, *y = b;
+    if (x->dev != y->dev) {
+        return (x->dev < y->dev) ? -1 : 1;
+    }
+    return (x->ino > y->ino) - (x->ino < y->ino);
+}
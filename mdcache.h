@@ -0,0 +1,8 @@
+/* MDCACHE.H - header file for MDCACHE.C */
+
+#include <sys/stat.h>
+
+i32 MDCacheOpen(const char *);
+i32 MDCacheLookup(const struct stat *, u8[16]);
+void MDCacheStore(const struct stat *, u8[16]);
+i32 MDCacheSave(void);
@@ -0,0 +1,306 @@
+/* MDCHUNK.C - content-defined chunking and chunk index for the MD driver */
+
+/* Chunk boundaries follow the content, so that an insertion only moves
+ * the boundaries near it. A gear hash rolls over the data, one shift
+ * and one table lookup per byte, and a chunk ends where the top bits of
+ * the hash are zero. Cutting is normalized as in FastCDC: below the
+ * average size more bits must be zero than above it, which keeps chunk
+ * sizes close to the average. The gear table comes from a fixed seed
+ * and must never change, or no chunk would match an older index; the
+ * chunk test of mddriver -x pins the boundaries it gives.
+ *
+ * The chunk index holds the digest and length of every chunk seen.
+ * File format, in host byte order like the digest cache:
+ *   header  - magic "MD5CHUNK", u32 version, u32 byte order mark
+ *             (0x01020304), u64 entry count
+ *   entries - MD_CHUNK_ENTRY[count], sorted by digest
+ * Lookups binary-search the mapping; chunks added during the run go in
+ * an in-memory hash table, and are merged in by MDChunkIndexSave. */
+
+#include "global.h"
+#include "mdchunk.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define MD_CHUNK_VERSION 1
+#define MD_CHUNK_BOM 0x01020304
+#define MD_CHUNK_SEED 0x6d643563686e6b31
+
+typedef struct {
+    u8 magic[8];
+    u32 version;
+    u32 bom;
+    u64 count;
+} MD_CHUNK_HEADER;
+
+typedef struct {
+    u8 digest[16];
+    u64 len; /* 0 marks a free slot of the table */
+} MD_CHUNK_ENTRY;
+
+static u64 gear[256];
+
+static char *indexPath = NULL;
+static i32 indexOpen = 0;
+static u8 *map = NULL;
+static size_t mapLen = 0;
+static const MD_CHUNK_ENTRY *entry = NULL; /* in map */
+static u64 entries = 0;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static MD_CHUNK_ENTRY *table = NULL; /* added during this run */
+static u64 tableSize = 0;            /* a power of 2 */
+static u64 tableCount = 0;
+
+static void MDGearInit(void);
+static MD_CHUNK_ENTRY *MDTableSlot(MD_CHUNK_ENTRY *, u64, const u8[16]);
+static i32 MDTableGrow(void);
+static i32 CompareDigests(const void *, const void *);
+
+/* Sets up chunker for chunks of min to max bytes, averaging about avg.
+ * Returns -1 unless 64 <= min <= avg <= max <= 1G. */
+i32 MDChunkerInit(MD_CHUNKER *chunker, u64 min, u64 avg, u64 max) {
+    if (min < 64 || min > avg || avg > max || max > (1 << 30)) {
+        return -1;
+    }
+    MDGearInit();
+
+    u32 bits = 0;
+    while (((u64)2 << bits) <= avg) {
+        bits++;
+    }
+    chunker->min = min;
+    chunker->avg = avg;
+    chunker->max = max;
+    chunker->maskS = ~(~(u64)0 >> (bits + 1));
+    chunker->maskL = ~(~(u64)0 >> (bits - 1));
+    return 0;
+}
+
+/* Returns the length of the first chunk of the len bytes at data. A
+ * return of len short of chunker->max means that no boundary was
+ * found: the chunk may go on past len. */
+u64 MDChunkCut(const MD_CHUNKER *chunker, const u8 *data, u64 len) {
+    if (len <= chunker->min) {
+        return len;
+    }
+    u64 end = (len < chunker->max) ? len : chunker->max;
+    u64 normal = (end < chunker->avg) ? end : chunker->avg;
+
+    /* The first min bytes can't end a chunk and are not hashed. */
+    u64 hash = 0;
+    u64 i = chunker->min;
+    for (; i < normal; i++) {
+        hash = (hash << 1) + gear[data[i]];
+        if ((hash & chunker->maskS) == 0) {
+            return i + 1;
+        }
+    }
+    for (; i < end; i++) {
+        hash = (hash << 1) + gear[data[i]];
+        if ((hash & chunker->maskL) == 0) {
+            return i + 1;
+        }
+    }
+    return end;
+}
+
+/* Opens the chunk index at path, mapping it if it exists and is valid,
+ * or an index kept in memory only if path is NULL. A missing or invalid
+ * index starts out empty. Returns -1 if an index is already open. */
+i32 MDChunkIndexOpen(const char *path) {
+    if (indexOpen) {
+        return -1;
+    }
+    indexOpen = 1;
+    if (path == NULL) {
+        return 0;
+    }
+    indexPath = strdup(path);
+
+    i32 fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return 0;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && (u64)st.st_size >= sizeof(MD_CHUNK_HEADER)) {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) {
+            map = NULL;
+        } else {
+            mapLen = st.st_size;
+        }
+    }
+    close(fd);
+
+    if (map != NULL) {
+        const MD_CHUNK_HEADER *header = (const MD_CHUNK_HEADER *)map;
+        u64 room = (mapLen - sizeof(*header)) / sizeof(MD_CHUNK_ENTRY);
+        if (memcmp(header->magic, "MD5CHUNK", 8) == 0 &&
+            header->version == MD_CHUNK_VERSION &&
+            header->bom == MD_CHUNK_BOM && header->count <= room) {
+            entry = (const MD_CHUNK_ENTRY *)(header + 1);
+            entries = header->count;
+        }
+    }
+    return 0;
+}
+
+/* Records a chunk of len bytes with digest. Returns 1 if the index held
+ * it already, and 0 if it is new (or can't be recorded). Safe to call
+ * from several threads. */
+i32 MDChunkIndexAdd(const u8 digest[16], u64 len) {
+    if (entries > 0 &&
+        bsearch(digest, entry, entries, sizeof(*entry), CompareDigests)) {
+        return 1;
+    }
+
+    pthread_mutex_lock(&lock);
+    if (2 * (tableCount + 1) > tableSize && MDTableGrow() != 0) {
+        pthread_mutex_unlock(&lock);
+        return 0;
+    }
+    MD_CHUNK_ENTRY *slot = MDTableSlot(table, tableSize, digest);
+    i32 found = (slot->len != 0);
+    if (!found) {
+        memcpy(slot->digest, digest, 16);
+        slot->len = len;
+        tableCount++;
+    }
+    pthread_mutex_unlock(&lock);
+    return found;
+}
+
+/* Writes the index back with the chunks added during this run. The new
+ * index replaces the old one atomically. Returns -1 on failure. */
+i32 MDChunkIndexSave(void) {
+    if (indexPath == NULL || tableCount == 0) {
+        return 0;
+    }
+
+    MD_CHUNK_ENTRY *added = malloc(tableCount * sizeof(*added));
+    size_t tmpLen = strlen(indexPath) + 5;
+    char *tmp = malloc(tmpLen);
+    if (added == NULL || tmp == NULL) {
+        free(added);
+        free(tmp);
+        return -1;
+    }
+    u64 count = 0;
+    for (u64 i = 0; i < tableSize; i++) {
+        if (table[i].len != 0) {
+            added[count++] = table[i];
+        }
+    }
+    qsort(added, count, sizeof(*added), CompareDigests);
+    snprintf(tmp, tmpLen, "%s.tmp", indexPath);
+
+    FILE *file = fopen(tmp, "wb");
+    if (file == NULL) {
+        free(added);
+        free(tmp);
+        return -1;
+    }
+
+    MD_CHUNK_HEADER header;
+    memcpy(header.magic, "MD5CHUNK", 8);
+    header.version = MD_CHUNK_VERSION;
+    header.bom = MD_CHUNK_BOM;
+    header.count = entries + count;
+    fwrite(&header, sizeof(header), 1, file);
+
+    /* Merge the two sorted lists; added chunks are never in the map. */
+    u64 i = 0, j = 0;
+    while (i < entries || j < count) {
+        if (j == count ||
+            (i < entries && CompareDigests(&entry[i], &added[j]) < 0)) {
+            fwrite(&entry[i++], sizeof(*entry), 1, file);
+        } else {
+            fwrite(&added[j++], sizeof(*added), 1, file);
+        }
+    }
+
+    i32 status = (ferror(file) || fclose(file) != 0) ? -1 : 0;
+    if (status == 0) {
+        status = rename(tmp, indexPath);
+    } else {
+        remove(tmp);
+    }
+    free(added);
+    free(tmp);
+    return status;
+}
+
+/* Closes the index, dropping chunks added since it was last saved, so
+ * that an index can be opened again. */
+void MDChunkIndexClose(void) {
+    if (map != NULL) {
+        munmap(map, mapLen);
+    }
+    free(indexPath);
+    free(table);
+    indexPath = NULL;
+    indexOpen = 0;
+    map = NULL;
+    mapLen = 0;
+    entry = NULL;
+    entries = 0;
+    table = NULL;
+    tableSize = tableCount = 0;
+}
+
+/* Fills the gear table from a fixed seed with splitmix64. */
+static void MDGearInit(void) {
+    u64 x = MD_CHUNK_SEED;
+    for (u32 i = 0; i < 256; i++) {
+        u64 z = (x += 0x9e3779b97f4a7c15);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+        gear[i] = z ^ (z >> 31);
+    }
+}
+
+/* Returns the slot of digest in a table of size slots, or the free slot
+ * where it would go. Digests are uniform, so their first bytes serve as
+ * the hash. */
+static MD_CHUNK_ENTRY *MDTableSlot(MD_CHUNK_ENTRY *slots, u64 size,
+                                   const u8 digest[16]) {
+    u64 h;
+    memcpy(&h, digest, 8);
+    for (u64 i = h & (size - 1);; i = (i + 1) & (size - 1)) {
+        if (slots[i].len == 0 || memcmp(slots[i].digest, digest, 16) == 0) {
+            return &slots[i];
+        }
+    }
+}
+
+/* Doubles the table, rehashing its entries. Returns -1 on failure. */
+static i32 MDTableGrow(void) {
+    u64 size = tableSize ? 2 * tableSize : 1024;
+    MD_CHUNK_ENTRY *grown = calloc(size, sizeof(*grown));
+    if (grown == NULL) {
+        return -1;
+    }
+    for (u64 i = 0; i < tableSize; i++) {
+        if (table[i].len != 0) {
+            *MDTableSlot(grown, size, table[i].digest) = table[i];
+        }
+    }
+    free(table);
+    table = grown;
+    tableSize = size;
+    return 0;
+}
+
+/* Orders MD_CHUNK_ENTRYs, or a digest and an entry, by digest. */
+static i32 CompareDigests(const void *a, const void *b) {
+    return memcmp(a, b, 16);
+}
@@ -0,0 +1,18 @@
+/* MDCHUNK.H - header file for MDCHUNK.C */
+
+/* Content-defined chunk sizes and cut masks; see MDChunkerInit. */
+typedef struct {
+    u64 min;
+    u64 avg;
+    u64 max;
+    u64 maskS; /* cut mask below avg bytes */
+    u64 maskL; /* cut mask from avg bytes on */
+} MD_CHUNKER;
+
+i32 MDChunkerInit(MD_CHUNKER *, u64, u64, u64);
+u64 MDChunkCut(const MD_CHUNKER *, const u8 *, u64);
+
+i32 MDChunkIndexOpen(const char *);
+i32 MDChunkIndexAdd(const u8[16], u64);
+i32 MDChunkIndexSave(void);
+void MDChunkIndexClose(void);
@@ -0,0 +1,149 @@
+/* MDCLIENT.C - client library for the MD hashing daemon */
+
+/* A client is one connection to the daemon. MDClientHash sends one
+ * message and waits for its digest; MDClientSend and MDClientReceive
+ * keep several requests in flight, matched up by tag. A client must not
+ * be used by two threads at once. Needs only libc: programs that hash
+ * through the daemon link this file alone. */
+
+#include "global.h"
+#include "mdclient.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+struct MD_CLIENT {
+    i32 fd;
+    u64 tag; /* last tag used by MDClientHash */
+};
+
+static i32 WriteAll(i32, struct iovec *, i32);
+static i32 ReadAll(i32, void *, size_t);
+
+/* Connects to the daemon listening at path. Returns NULL on failure. */
+MD_CLIENT *MDClientOpen(const char *path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        return NULL;
+    }
+    strcpy(addr.sun_path, path);
+
+    MD_CLIENT *client = malloc(sizeof(*client));
+    if (client == NULL) {
+        return NULL;
+    }
+    client->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    client->tag = 0;
+    if (client->fd < 0 ||
+        connect(client->fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        MDClientClose(client);
+        return NULL;
+    }
+    return client;
+}
+
+/* Digests the len bytes at input through the daemon. Returns -1 if the
+ * daemon can't be reached or refuses the message. */
+i32 MDClientHash(MD_CLIENT *client, const u8 *input, u32 len,
+                 u8 digest[16]) {
+    u64 tag = ++client->tag;
+    if (MDClientSend(client, tag, input, len) != 0) {
+        return -1;
+    }
+
+    u64 replied;
+    i32 status;
+    do {
+        status = MDClientReceive(client, &replied, digest);
+    } while (status == 0 && replied != tag);
+    return status;
+}
+
+/* Sends a request for the digest of the len bytes at input, to be
+ * answered under tag. Returns -1 on failure. */
+i32 MDClientSend(MD_CLIENT *client, u64 tag, const u8 *input, u32 len) {
+    MD_REQUEST request;
+    request.tag = tag;
+    request.len = len;
+    request.reserved = 0;
+
+    struct iovec iov[2];
+    iov[0].iov_base = &request;
+    iov[0].iov_len = sizeof(request);
+    iov[1].iov_base = (void *)input;
+    iov[1].iov_len = len;
+    return WriteAll(client->fd, iov, 2);
+}
+
+/* Waits for the next reply, and stores its tag and digest. Returns -1
+ * if the connection failed or the request was refused. */
+i32 MDClientReceive(MD_CLIENT *client, u64 *tag, u8 digest[16]) {
+    MD_REPLY reply;
+    if (ReadAll(client->fd, &reply, sizeof(reply)) != 0) {
+        return -1;
+    }
+    *tag = reply.tag;
+    memcpy(digest, reply.digest, 16);
+    return (reply.status == 0) ? 0 : -1;
+}
+
+/* Closes the connection. */
+void MDClientClose(MD_CLIENT *client) {
+    if (client->fd >= 0) {
+        close(client->fd);
+    }
+    free(client);
+}
+
+/* Writes count buffers to fd in full. Returns -1 on failure; a daemon
+ * gone away does not raise SIGPIPE. */
+static i32 WriteAll(i32 fd, struct iovec *iov, i32 count) {
+    while (count > 0) {
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = count;
+        ssize_t n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        while (count > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (u8 *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+/* Reads len bytes from fd into buffer. Returns -1 on failure or end of
+ * file. */
+static i32 ReadAll(i32 fd, void *buffer, size_t len) {
+    u8 *p = buffer;
+    while (len > 0) {
+        ssize_t n = read(fd, p, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
@@ -0,0 +1,29 @@
+/* MDCLIENT.H - header file for MDCLIENT.C */
+
+/* Wire format of the hashing daemon, in host byte order. A request is
+ * a header followed by len message bytes; its reply carries the same
+ * tag, with status 0 and the digest, or status -1 if the message was
+ * longer than MD_SERVE_MAX_LEN (the daemon then drops the connection).
+ * Replies may come back in any order. */
+#define MD_SERVE_MAX_LEN (1 << 20)
+
+typedef struct {
+    u64 tag;
+    u32 len;
+    u32 reserved;
+} MD_REQUEST;
+
+typedef struct {
+    u64 tag;
+    i32 status;
+    u32 reserved;
+    u8 digest[16];
+} MD_REPLY;
+
+typedef struct MD_CLIENT MD_CLIENT;
+
+MD_CLIENT *MDClientOpen(const char *);
+i32 MDClientHash(MD_CLIENT *, const u8 *, u32, u8[16]);
+i32 MDClientSend(MD_CLIENT *, u64, const u8 *, u32);
+i32 MDClientReceive(MD_CLIENT *, u64 *, u8[16]);
+void MDClientClose(MD_CLIENT *);
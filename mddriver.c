@@ -13,52 +13,490 @@
 
 #include "global.h"
 #include "md5.h"
+#include "mdbench.h"
+#include "mdcache.h"
+#include "mdchunk.h"
+#include "mdclient.h"
+#include "mdline.h"
+#include "mdload.h"
+#include "mdout.h"
+#include "mdpool.h"
+#include "mdserve.h"
+#include "mdstats.h"
+#include "mdsums.h"
 
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <signal.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 #include <time.h>
+#include <unistd.h>
 
-/* Length of test block, number of test blocks. */
-#define TEST_BLOCK_LEN 10000
-#define TEST_BLOCK_COUNT 10000
+/* Default largest message size of the benchmarks. The sweep goes to
+ * 1 GiB with -t1G, but that needs 1 GiB of memory and, with at least
+ * three samples of every API on every kernel, takes minutes; sizes
+ * past a few MiB only repeat the bulk throughput. */
+#define BENCH_LEN (16 << 20)
 
-static void MDString(u8 *);
-static void MDTimeTrial(void);
-static void MDTestSuite(void);
-static void MDFile(char *);
-static void MDFilter(void);
-static void MDPrint(u8[16]);
+/* Default length and number of read-ahead buffers. Files that are
+ * read fill up to READ_BUFFERS buffers ahead of the hashing. Mapped
+ * files are hashed in one pass over the mapping and left to the
+ * kernel's read-ahead, so the buffers don't apply to them. */
+#define READ_BUFFER_LEN (1 << 20)
+#define READ_BUFFERS 4
+#define MAX_READ_BUFFERS 64
+
+/* Files of at least LARGE_FILE_LEN bytes are digested by a worker of
+ * their own; smaller ones in batches of up to BATCH_LEN bytes or
+ * BATCH_FILES files. At most WINDOW_FILES files are in flight. */
+#define LARGE_FILE_LEN (8 << 20)
+#define BATCH_LEN (8 << 20)
+#define BATCH_FILES 256
+#define WINDOW_FILES (1 << 16)
+
+/* With -u, a checkpoint of each file's context is kept in the file name
+ * plus CHECKPOINT_SUFFIX. It holds the exported context, the file's
+ * inode (64 bits little-endian), and the digest of the CHECKPOINT_TAIL
+ * bytes before the checkpoint, which must still match for it to be
+ * used. */
+#define CHECKPOINT_SUFFIX ".md5ctx"
+#define CHECKPOINT_LEN (MD5_EXPORT_LEN + 8 + 16)
+#define CHECKPOINT_TAIL 4096
+
+/* With -d, files are cut into content-defined chunks of CHUNK_MIN to
+ * CHUNK_MAX bytes, CHUNK_AVG on average, unless --chunk says otherwise.
+ * Up to CHUNK_BATCH chunks are digested side by side. */
+#define CHUNK_MIN (2 << 10)
+#define CHUNK_AVG (8 << 10)
+#define CHUNK_MAX (64 << 10)
+#define CHUNK_BATCH 128
+
+/* The daemon holds requests for up to SERVE_DEADLINE microseconds to
+ * batch them, unless --deadline says otherwise. The load generator runs
+ * up to LOAD_CLIENTS clients with LOAD_LEN-byte messages by default. */
+#define SERVE_DEADLINE 100
+#define LOAD_CLIENTS 64
+#define LOAD_LEN 64
+
+/* With -l, up to LINE_WINDOW records are split off at a time, and
+ * digested in groups of LINE_GROUP, on the -j workers if there are
+ * several. */
+#define LINE_WINDOW (1 << 16)
+#define LINE_GROUP 256
+
+/* Output modes for digests: md5 text, binary records, JSON lines. */
+enum { OUT_TEXT, OUT_BINARY, OUT_JSON };
+
+static u32 readBufferLen = READ_BUFFER_LEN;
+static u32 readBuffers = READ_BUFFERS;
+static i32 useMap = 1;
+static i32 reportTimes = 0;
+static u32 threads = 1;
+static i32 recursive = 0;
+static i32 useCache = 0;
+static u32 verifyPercent = 0;
+static u64 verifySalt = 0; /* set before any worker starts */
+static u64 staleEntries = 0;
+static i32 stopAtMismatch = 0;
+static i32 exitStatus = 0; /* 1 once a check fails or a file can't be read */
+static u64 partLen = 0;
+static i32 benchJson = 0;
+static i32 resume = 0;
+static i32 outputMode = OUT_TEXT;
+static i32 chunking = 0;
+static MD_CHUNKER chunker;
+static u64 totalChunks = 0;
+static u64 totalNew = 0;
+static u64 totalDuplicate = 0;
+static u64 serveDeadline = SERVE_DEADLINE;
+static i32 lineMode = 0;
+static i32 lineOffsets = 0;
+static u64 lineInputs = 0;
+static i32 multiDigest = 0;
+
+/* Seconds spent waiting for file data, and digesting it. */
+typedef struct {
+    double io;
+    double hash;
+} MD_TIMES;
+
+/* Read-ahead ring shared by the reader thread and the hashing thread.
+ * The i-th chunk of the file goes into slot i % count; a chunk of
+ * length 0 or less marks the end of the file. */
+typedef struct {
+    i32 fd;
+    u32 count;
+    u32 size;
+    u8 *data;
+    ssize_t len[MAX_READ_BUFFERS];
+    u64 filled;
+    u64 consumed;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} MD_RING;
+
+/* Failure statuses of MD_FILE and the digest functions. */
+enum { FILE_UNOPENED = -1, FILE_UNREAD = -2 };
+
+/* A file of a parallel run and its result. */
+typedef struct {
+    char *name;
+    u64 size; /* 0 if it can't be stat'ed */
+    i32 status; /* 0, FILE_UNOPENED or FILE_UNREAD */
+    i32 done;
+    u8 digest[16];
+    u64 parts; /* with -p */
+    u64 chunks; /* with -d */
+    u64 newBytes;
+    u64 duplicateBytes;
+    i32 hasSums; /* with -m: crc32c and len are set */
+    u32 crc32c;
+    u64 len;
+    MD_TIMES times;
+} MD_FILE;
+
+/* A consumer of the data of a file. MDMapUpdate, MDReadUpdate and
+ * MDRingUpdate pass each span of the file to span, in order, as they
+ * have it. */
+typedef struct {
+    void (*span)(void *, const u8 *, u64);
+    void *arg;
+} MD_SINK;
+
+/* The chunking stage of -d, in front of the digest: cuts the spans it
+ * is passed into chunks, counts them into file, and passes them on to
+ * next. A last chunk that may go on into the next span waits in carry,
+ * which holds two of the largest chunks. */
+typedef struct {
+    MD_SINK *next;
+    MD_FILE *file;
+    u8 *carry;
+    u64 have;
+    u64 size;
+} MD_CHUNKS;
+
+/* Consecutive files digested by one pool task. */
+typedef struct {
+    u64 first;
+    u64 count;
+    u64 bytes;
+} MD_BATCH;
+
+/* A parallel run over files; batches are in the order handed to the
+ * pool. The lock and cond publish the done flags. Once stop is set,
+ * files not yet started are skipped. */
+typedef struct {
+    MD_FILE *file;
+    u64 files;
+    MD_BATCH *batch;
+    u64 batches;
+    i32 stop;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} MD_RUN;
+
+/* The mapped parts of a file in -p mode; each pool task digests group
+ * consecutive parts. */
+typedef struct {
+    u8 *data;
+    u64 size;
+    u64 parts;
+    u64 group;
+    u8 (*digest)[16];
+} MD_PARTS;
+
+/* A window of records in -l mode: where each starts, its length and its
+ * digest, and the newlines found. */
+typedef struct {
+    const u8 *input[LINE_WINDOW];
+    u64 len[LINE_WINDOW];
+    u8 digest[LINE_WINDOW][16];
+    u64 end[LINE_WINDOW];
+    u64 records;
+} MD_LINES;
+
+/* Reports the result for the i-th file of a run, in order. Returns
+ * nonzero to stop the run. */
+typedef i32 (*MD_REPORT)(void *, u64, MD_FILE *);
+
+/* A window of manifest entries being checked, and the counts so far. */
+typedef struct {
+    char *name[WINDOW_FILES];
+    u8 expected[WINDOW_FILES][16];
+    u64 matched;
+    u64 failed;
+    u64 unreadable;
+    u64 malformed;
+} MD_CHECK;
+
+/* A parallel directory walk, one level of the tree at a time. Each level
+ * lists the directories in dir and collects the files found and the
+ * directories of the next level. */
+typedef struct {
+    char **dir;
+    u64 dirs;
+    char **next;
+    u64 nexts;
+    u64 nextSize;
+    char **file;
+    u64 files;
+    u64 fileSize;
+    pthread_mutex_t lock;
+} MD_WALK;
 
 #define MD_CTX MD5_CTX
 #define MDInit MD5Init
-#define MDUpdate MD5Update
+#define MDUpdate MD5Update64
 #define MDFinal MD5Final
 
+static void MDString(u8 *);
+static void MDKernel(char *);
+static void MDTimeTrial(char *);
+static void MDTestSuite(void);
+static void MDLaneTest(u32);
+static void MDBatchTest(void);
+static void MDExportTest(void);
+static void MDHmacTest(void);
+static void MDShortTest(void);
+static void MDFixedTest(void);
+static void MDHexTest(void);
+static void MDLineTest(void);
+static u32 MDLineScanTest(MD_LINE_KERNEL *);
+static void MDChunkTest(void);
+static i32 MDChunkIndexTest(void);
+static void MDSumsTest(void);
+static u32 MDCrcKernelTest(MD_CRC_KERNEL *, const u8 *);
+static void MDServeTest(void);
+static void MDFile(char *);
+static i32 MDFileResult(void *, u64, MD_FILE *);
+static void MDFiles(char **, u64);
+static i32 MDFilesFlat(char **, u64, MD_REPORT, void *);
+static void MDTree(char *);
+static void MDWalkTask(void *, u64);
+static i32 MDAppend(char ***, u64 *, u64 *, char *);
+static i32 ComparePaths(const void *, const void *);
+static void MDCache(char *);
+static void MDVerifyCache(char *);
+static i32 MDFilesWindow(char **, u64, u64, MD_REPORT, void *);
+static void MDStatTask(void *, u64);
+static void MDHashTask(void *, u64);
+static i32 CompareBatches(const void *, const void *);
+static void MDThreads(char *);
+static void MDStats(char *);
+static void MDCheck(char *);
+static char *MDParseLine(char *, u8[16]);
+static i32 MDUnescape(char *);
+static i32 MDCheckResult(void *, u64, MD_FILE *);
+static void MDPrintName(char *);
+static void MDDigest(MD_FILE *);
+static i32 MDFileDigest(MD_FILE *);
+static i32 MDPartsDigest(char *, u8[16], u64 *, MD_TIMES *);
+static i32 MDResumeDigest(MD_FILE *);
+static i32 MDLoadCheckpoint(char *, i32, struct stat *, MD_CTX *);
+static i32 MDSaveCheckpoint(char *, i32, struct stat *, MD_CTX *);
+static i32 MDTailDigest(i32, u64, u8[16]);
+static char *MDCheckpointName(char *, const char *);
+static void MDPartTask(void *, u64);
+static void MDLines(char *);
+static u64 MDLineSpan(MD_LINES *, const u8 *, u64, u64, i32);
+static void MDLineTask(void *, u64);
+static void MDPrintLine(u8[16], u64);
+static i32 MDChunksInit(MD_CHUNKS *, MD_SINK *, MD_FILE *);
+static void MDChunksSpan(void *, const u8 *, u64);
+static void MDChunksEnd(MD_CHUNKS *);
+static u64 MDChunkSpan(MD_CHUNKS *, const u8 *, u64, i32);
+static void MDContextSpan(void *, const u8 *, u64);
+static void MDSumsSpan(void *, const u8 *, u64);
+static i32 MDMapUpdate(MD_SINK *, i32, u64, MD_TIMES *);
+static i32 MDReadUpdate(MD_SINK *, i32, MD_TIMES *);
+static i32 MDRingUpdate(MD_SINK *, i32, MD_TIMES *, i32 *);
+static void *MDReadAhead(void *);
+static ssize_t MDReadFull(i32, u8 *, u32);
+static u8 *MDAlloc(size_t);
+static double MDNow(void);
+static i32 MDSize(char *, u64 *);
+static void MDBufferLen(char *);
+static void MDPartLen(char *);
+static void MDChunks(char *);
+static void MDChunkSizes(char *);
+static void MDServeOn(char *);
+static void MDDeadline(char *);
+static void MDLoadOn(char *);
+static void MDBufferCount(char *);
+static void MDFilter(void);
+static void MDPrintResult(const char *, char *, u8[16], MD_FILE *);
+
 /* Main driver.
  *
  * Arguments (may be any combination):
  *   -sstring - digests string
- *   -t       - runs time trial
+ *   -kname   - selects transform kernel (see MD5_KERNEL)
+ *   -bsize   - sets read buffer size for unmapped files (K, M, G suffix)
+ *   -acount  - sets number of read-ahead buffers (1 disables read-ahead)
+ *   -n       - reads files instead of memory-mapping them
+ *   -w       - reports I/O wait and compute time per file (stderr)
+ *              -a, -b and the I/O wait of -w only apply to files that
+ *              are read (-n, pipes, standard input); the page faults
+ *              of a mapped file count as compute
+ *   -jcount  - digests files on count workers (0: one per CPU)
+ *   -psize   - prints multipart digests of size-byte parts (S3 ETags);
+ *              a file of one part gets its plain digest, as S3 gives it
+ *   -u       - resumes files from checkpoints, digesting appended data
+ *   -d[path] - cuts files into content-defined chunks and reports new
+ *              and duplicate bytes (stderr), against a chunk index kept
+ *              in path (none: for this run only)
+ *   --chunk=min,avg,max
+ *            - sets chunk sizes for -d (2K,8K,64K; K, M, G suffix)
+ *   -l       - digests each line of the files that follow ("-":
+ *              standard input; none: standard input), one digest per
+ *              line in order
+ *   --offsets
+ *            - prints the byte offset of each line after its digest
+ *   -m       - also prints the CRC32C and length of each file, computed
+ *              from the same read as the digest (not with -p, -u)
+ *   -r       - digests directories recursively
+ *   -Cpath   - keeps a digest cache in path, skipping unchanged files
+ *   --verify-cache[=percent]
+ *            - re-digests a sample of cache hits (default 1 percent)
+ *   -cfile   - checks the digests listed in file ("-": standard input)
+ *   -e       - stops checking at the first mismatch
+ *   -t[size] - runs benchmarks on messages of up to size bytes (16M;
+ *              -t1G sweeps to 1 GiB, but takes minutes and 1 GiB of
+ *              memory)
+ *   --binary - prints digests as binary records: digest, name, NUL;
+ *              with -m the CRC32C (4 bytes) and length (8 bytes) follow
+ *              the digest, with -l --offsets the offset (8 bytes) does,
+ *              all big-endian
+ *   --json   - prints benchmark and load results as JSON (anywhere on
+ *              the command line), and the digests after it as JSON lines
+ *   --stats[=perf]
+ *            - prints run statistics (stderr), with perf: CPU counters
+ *   --serve=path
+ *            - runs a hashing daemon on a Unix socket at path, batching
+ *              requests across -j workers (see mdclient.h)
+ *   --deadline=usec
+ *            - sets how long the daemon holds requests to fill a batch
+ *              (100 microseconds)
+ *   --load=path[,clients[,size]]
+ *            - loads the daemon at path with up to clients clients (64)
+ *              sending size-byte messages (64), reporting latency
  *   -x       - runs test script
  *   filename - digests file
  *   (none)   - digests standard input */
 i32 main(i32 argc, char *argv[]) {
+    /* Benchmarks print JSON whether --json comes before or after -t. */
+    for (i32 i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--json") == 0) {
+            benchJson = 1;
+        }
+    }
+
     if (argc > 1) {
-        for (i32 i = 1; i < argc; i++)
+        /* Runs of filenames are digested together, so that -j can hash
+         * them in parallel. Options end a run. */
+        i32 run = 0;
+        for (i32 i = 1; i < argc; i++) {
+            if (argv[i][0] == '-' && run > 0) {
+                MDFiles(argv + i - run, run);
+                run = 0;
+            }
+
             if (argv[i][0] == '-' && argv[i][1] == 's') {
                 MDString((u8 *)argv[i] + 2);
-            } else if (strcmp(argv[i], "-t") == 0) {
-                MDTimeTrial();
+            } else if (argv[i][0] == '-' && argv[i][1] == 'k') {
+                MDKernel(argv[i] + 2);
+            } else if (argv[i][0] == '-' && argv[i][1] == 'b') {
+                MDBufferLen(argv[i] + 2);
+            } else if (argv[i][0] == '-' && argv[i][1] == 'a') {
+                MDBufferCount(argv[i] + 2);
+            } else if (strcmp(argv[i], "-n") == 0) {
+                useMap = 0;
+            } else if (strcmp(argv[i], "-w") == 0) {
+                reportTimes = 1;
+            } else if (argv[i][0] == '-' && argv[i][1] == 'j') {
+                MDThreads(argv[i] + 2);
+            } else if (argv[i][0] == '-' && argv[i][1] == 'p') {
+                MDPartLen(argv[i] + 2);
+            } else if (strcmp(argv[i], "-u") == 0) {
+                resume = 1;
+            } else if (argv[i][0] == '-' && argv[i][1] == 'd') {
+                MDChunks(argv[i] + 2);
+            } else if (strncmp(argv[i], "--chunk=", 8) == 0) {
+                MDChunkSizes(argv[i] + 8);
+            } else if (strcmp(argv[i], "-l") == 0) {
+                lineMode = 1;
+            } else if (strcmp(argv[i], "--offsets") == 0) {
+                lineOffsets = 1;
+            } else if (strcmp(argv[i], "-m") == 0) {
+                multiDigest = 1;
+            } else if (strcmp(argv[i], "-r") == 0) {
+                recursive = 1;
+            } else if (argv[i][0] == '-' && argv[i][1] == 'C') {
+                MDCache(argv[i] + 2);
+            } else if (strncmp(argv[i], "--verify-cache", 14) == 0) {
+                MDVerifyCache(argv[i] + 14);
+            } else if (argv[i][0] == '-' && argv[i][1] == 'c') {
+                MDCheck(argv[i] + 2);
+            } else if (strcmp(argv[i], "-e") == 0) {
+                stopAtMismatch = 1;
+            } else if (argv[i][0] == '-' && argv[i][1] == 't') {
+                MDTimeTrial(argv[i] + 2);
+            } else if (strcmp(argv[i], "--binary") == 0) {
+                outputMode = OUT_BINARY;
+            } else if (strcmp(argv[i], "--json") == 0) {
+                outputMode = OUT_JSON;
+            } else if (strncmp(argv[i], "--stats", 7) == 0) {
+                MDStats(argv[i] + 7);
+            } else if (strncmp(argv[i], "--serve=", 8) == 0) {
+                MDServeOn(argv[i] + 8);
+            } else if (strncmp(argv[i], "--deadline=", 11) == 0) {
+                MDDeadline(argv[i] + 11);
+            } else if (strncmp(argv[i], "--load=", 7) == 0) {
+                MDLoadOn(argv[i] + 7);
             } else if (strcmp(argv[i], "-x") == 0) {
                 MDTestSuite();
+            } else if (argv[i][0] != '-') {
+                run++;
             } else {
                 MDFile(argv[i]);
             }
+        }
+        MDFiles(argv + argc - run, run);
+        if (lineMode && lineInputs == 0) {
+            MDLines("-");
+            MDOutFlush();
+        }
     } else {
         MDFilter();
     }
 
-    return (0);
+    if (staleEntries > 0) {
+        fprintf(stderr, "%llu stale cache entries\n",
+                (unsigned long long)staleEntries);
+    }
+    if (useCache && MDCacheSave() != 0) {
+        printf("cache can't be written\n");
+    }
+    if (chunking) {
+        fprintf(stderr, "%llu chunks, %llu new bytes, %llu duplicate bytes\n",
+                (unsigned long long)totalChunks, (unsigned long long)totalNew,
+                (unsigned long long)totalDuplicate);
+        if (MDChunkIndexSave() != 0) {
+            printf("chunk index can't be written\n");
+        }
+    }
+    if (mdStatsEnabled) {
+        MDStatsPrint();
+    }
+
+    return (exitStatus);
 }
 
 /* Digests a string and prints the result. */
@@ -72,47 +510,32 @@ static void MDString(u8 *string) {
     u8 digest[16];
     MDFinal(digest, &context);
 
-    printf("MD5 (\"%s\") = ", string);
-    MDPrint(digest);
-    printf("\n");
+    MDPrintResult("string", (char *)string, digest, NULL);
+    MDOutFlush();
 }
 
-/* Measures the time to digest TEST_BLOCK_COUNT TEST_BLOCK_LEN-byte
- *  blocks. */
-static void MDTimeTrial() {
-    printf("MD5 time trial. Digesting %d %d-byte blocks ...", TEST_BLOCK_LEN,
-           TEST_BLOCK_COUNT);
-
-    /* Initialize block */
-    u8 block[TEST_BLOCK_LEN];
-    for (u32 i = 0; i < TEST_BLOCK_LEN; i++) {
-        block[i] = (u8)(i & 0xff);
+/* Selects a transform kernel, or lists the supported ones if name is
+ * unknown. */
+static void MDKernel(char *name) {
+    if (MD5SetKernel(name) != 0) {
+        printf("%s kernel not supported; available:", name);
+        const char *kernel;
+        for (u32 i = 0; (kernel = MD5KernelName(i)) != NULL; i++) {
+            printf(" %s", kernel);
+        }
+        printf("\n");
     }
+}
 
-    /* Start timer */
-    time_t startTime;
-    time(&startTime);
-
-    /* Digest blocks */
-    MD_CTX context;
-    MDInit(&context);
-    for (u32 i = 0; i < TEST_BLOCK_COUNT; i++) {
-        MDUpdate(&context, block, TEST_BLOCK_LEN);
+/* Runs the benchmarks on messages of up to size bytes, with an
+ * optional K, M or G suffix, or BENCH_LEN bytes if size is empty. */
+static void MDTimeTrial(char *size) {
+    u64 len = BENCH_LEN;
+    if (*size != '\0' && MDSize(size, &len) != 0) {
+        printf("%s benchmark size not supported\n", size);
+        return;
     }
-    u8 digest[16];
-    MDFinal(digest, &context);
-
-    /* Stop timer */
-    time_t endTime;
-    time(&endTime);
-
-    printf(" done\n");
-    printf("Digest = ");
-    MDPrint(digest);
-    printf("\nTime = %ld seconds\n", (long)(endTime - startTime));
-    printf("Speed = %ld bytes/second\n", (long)TEST_BLOCK_LEN *
-                                             (long)TEST_BLOCK_COUNT /
-                                             (endTime - startTime));
+    MDBench(len, benchJson);
 }
 
 /* Digests a reference suite of strings and prints the results. */
@@ -128,57 +551,2291 @@ static void MDTestSuite() {
         (u8 *)"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789");
     MDString((u8 *)"1234567890123456789012345678901234567890\
 1234567890123456789012345678901234567890");
+
+    MDLaneTest(4);
+    if (MD5MaxLanes() >= 8) {
+        MDLaneTest(8);
+    }
+    if (MD5MaxLanes() >= 16) {
+        MDLaneTest(16);
+    }
+    MDBatchTest();
+    MDExportTest();
+    MDHmacTest();
+    MDShortTest();
+    MDFixedTest();
+    MDHexTest();
+    MDLineTest();
+    MDChunkTest();
+    MDSumsTest();
+    MDServeTest();
 }
 
-/* Digests a file and prints the result. */
-static void MDFile(char *filename) {
-    FILE *file;
-    if ((file = fopen(filename, "rb")) == NULL) {
-        printf("%s can't be opened\n", filename);
+/* Digests lanes messages of different lengths with MD5UpdateLanes and
+ * checks each result against MDInit/MDUpdate/MDFinal. */
+static void MDLaneTest(u32 lanes) {
+    static u8 data[16][1000];
+    MD_CTX contexts[16];
+    MD_CTX *context[16];
+    u8 *input[16];
+    u32 len[16];
+
+    for (u32 l = 0; l < lanes; l++) {
+        for (u32 i = 0; i < sizeof(data[l]); i++) {
+            data[l][i] = (u8)(i * (l + 1));
+        }
+        context[l] = &contexts[l];
+        MDInit(context[l]);
+    }
+
+    /* Prefixes of different lengths leave the lanes at different buffer
+     * offsets; the rest gives them different block counts. */
+    for (u32 l = 0; l < lanes; l++) {
+        input[l] = data[l];
+        len[l] = l;
+    }
+    MD5UpdateLanes(context, input, len, lanes);
+    for (u32 l = 0; l < lanes; l++) {
+        input[l] = data[l] + l;
+        len[l] = sizeof(data[l]) - 12 * l;
     }
+    MD5UpdateLanes(context, input, len, lanes);
 
-    else {
+    u32 failed = 0;
+    for (u32 l = 0; l < lanes; l++) {
+        u8 digest[16];
+        MDFinal(digest, context[l]);
+
+        MD_CTX reference;
+        MDInit(&reference);
+        MDUpdate(&reference, data[l], l + len[l]);
+        u8 expected[16];
+        MDFinal(expected, &reference);
+
+        if (memcmp(digest, expected, 16) != 0) {
+            failed++;
+        }
+    }
+
+    printf("MD5 %u-lane test: %s\n", lanes, failed ? "failed" : "passed");
+}
+
+/* Digests a batch of messages of mixed lengths with MD5Batch and checks
+ * each result against MDInit/MDUpdate/MDFinal. */
+static void MDBatchTest() {
+    static u8 data[1200];
+    for (u32 i = 0; i < sizeof(data); i++) {
+        data[i] = (u8)(i * 7 + 3);
+    }
+
+    const u8 *input[200];
+    u64 len[200];
+    u8 digest[200][16];
+    for (u32 i = 0; i < 200; i++) {
+        input[i] = data + i;
+        len[i] = (i * 37) % 1000;
+    }
+    MD5Batch(input, len, digest, 200);
+
+    u32 failed = 0;
+    for (u32 i = 0; i < 200; i++) {
         MD_CTX context;
         MDInit(&context);
+        MDUpdate(&context, data + i, len[i]);
+        u8 expected[16];
+        MDFinal(expected, &context);
 
-        u8 buffer[1024];
-        i32 len;
-        while ((len = fread(buffer, 1, 1024, file))) {
-            MDUpdate(&context, buffer, len);
+        if (memcmp(digest[i], expected, 16) != 0) {
+            failed++;
         }
+    }
+
+    printf("MD5 batch test: %s\n", failed ? "failed" : "passed");
+}
+
+/* Exports a context after every prefix length of a message, imports it
+ * into a fresh context to digest the rest, and checks each result
+ * against MDInit/MDUpdate/MDFinal. */
+static void MDExportTest() {
+    static u8 data[200];
+    for (u32 i = 0; i < sizeof(data); i++) {
+        data[i] = (u8)(i * 13 + 5);
+    }
+
+    MD_CTX context;
+    MDInit(&context);
+    MDUpdate(&context, data, sizeof(data));
+    u8 expected[16];
+    MDFinal(expected, &context);
 
+    u32 failed = 0;
+    for (u32 split = 0; split <= sizeof(data); split++) {
+        MDInit(&context);
+        MDUpdate(&context, data, split);
+        u8 exported[MD5_EXPORT_LEN];
+        MD5Export(exported, &context);
+
+        MD_CTX resumed;
+        memset(&resumed, 0xa5, sizeof(resumed));
+        if (MD5Import(&resumed, exported) != 0) {
+            failed++;
+            continue;
+        }
+        MDUpdate(&resumed, data + split, sizeof(data) - split);
         u8 digest[16];
-        MDFinal(digest, &context);
+        MDFinal(digest, &resumed);
+
+        if (memcmp(digest, expected, 16) != 0) {
+            failed++;
+        }
+    }
 
-        fclose(file);
+    printf("MD5 export test: %s\n", failed ? "failed" : "passed");
+}
 
-        printf("MD5 (%s) = ", filename);
-        MDPrint(digest);
-        printf("\n");
+/* Checks MD5Hmac against the HMAC-MD5 test cases 1, 2 and 6 of RFC 2202,
+ * and MD5HmacInit/MD5Update/MD5HmacFinal against MD5Hmac for a message
+ * absorbed in pieces. */
+static void MDHmacTest() {
+    static u8 key1[16], key6[80];
+    memset(key1, 0x0b, sizeof(key1));
+    memset(key6, 0xaa, sizeof(key6));
+    static struct {
+        u8 *key;
+        u32 keyLen;
+        char *data;
+        u8 mac[16];
+    } tests[] = {
+        {key1, sizeof(key1), "Hi There",
+         {0x92, 0x94, 0x72, 0x7a, 0x36, 0x38, 0xbb, 0x1c, 0x13, 0xf4, 0x8e,
+          0xf8, 0x15, 0x8b, 0xfc, 0x9d}},
+        {(u8 *)"Jefe", 4, "what do ya want for nothing?",
+         {0x75, 0x0c, 0x78, 0x3e, 0x6a, 0xb0, 0xb5, 0x03, 0xea, 0xa8, 0x6e,
+          0x31, 0x0a, 0x5d, 0xb7, 0x38}},
+        {key6, sizeof(key6),
+         "Test Using Larger Than Block-Size Key - Hash Key First",
+         {0x6b, 0x1a, 0xb7, 0xfe, 0x4b, 0xd7, 0xbf, 0x8f, 0x0b, 0x62, 0xe6,
+          0xce, 0x61, 0xb9, 0xd0, 0xcd}},
+    };
+
+    u32 failed = 0;
+    for (u32 i = 0; i < sizeof(tests) / sizeof(tests[0]); i++) {
+        MD5_HMAC_KEY hmac;
+        MD5HmacKey(&hmac, tests[i].key, tests[i].keyLen);
+
+        u8 *data = (u8 *)tests[i].data;
+        u32 len = strlen(tests[i].data);
+        u8 mac[16];
+        MD5Hmac(mac, &hmac, data, len);
+        if (memcmp(mac, tests[i].mac, 16) != 0) {
+            failed++;
+        }
+
+        MD_CTX context;
+        MD5HmacInit(&context, &hmac);
+        MDUpdate(&context, data, 3);
+        MDUpdate(&context, data + 3, len - 3);
+        MD5HmacFinal(mac, &context, &hmac);
+        if (memcmp(mac, tests[i].mac, 16) != 0) {
+            failed++;
+        }
     }
+
+    printf("HMAC-MD5 test: %s\n", failed ? "failed" : "passed");
 }
 
-/* Digests the standard input and prints the result. */
-static void MDFilter() {
-    MD_CTX context;
-    MDInit(&context);
+/* Digests messages of every length MD5Short takes and checks each
+ * result against MDInit/MDUpdate/MDFinal. */
+static void MDShortTest() {
+    static u8 data[255];
+    for (u32 i = 0; i < sizeof(data); i++) {
+        data[i] = (u8)(i * 29 + 1);
+    }
+
+    u32 failed = 0;
+    for (u32 len = 0; len <= sizeof(data); len++) {
+        u8 digest[16];
+        MD5Short(data, (u8)len, digest);
+
+        MD_CTX context;
+        MDInit(&context);
+        MDUpdate(&context, data, len);
+        u8 expected[16];
+        MDFinal(expected, &context);
+
+        if (memcmp(digest, expected, 16) != 0) {
+            failed++;
+        }
+    }
+
+    printf("MD5 short test: %s\n", failed ? "failed" : "passed");
+}
+
+/* Digests 29 records of each fixed length, 16 + 8 + 4 + 1, so that
+ * every lane width up to MD5MaxLanes and the scalar code run, and checks
+ * each result against MDInit/MDUpdate/MDFinal. */
+static void MDFixedTest() {
+    static u8 data[29 * 64];
+    for (u32 i = 0; i < sizeof(data); i++) {
+        data[i] = (u8)(i * 11 + 7);
+    }
+
+    u32 failed = 0;
+    for (u32 len = 16; len <= 64; len *= 2) {
+        u8 digest[29][16], single[16];
+        switch (len) {
+        case 16: MD5Fixed16N(data, 29, digest); break;
+        case 32: MD5Fixed32N(data, 29, digest); break;
+        default: MD5Fixed64N(data, 29, digest); break;
+        }
+
+        for (u32 i = 0; i < 29; i++) {
+            switch (len) {
+            case 16: MD5Fixed16(data + 16 * i, single); break;
+            case 32: MD5Fixed32(data + 32 * i, single); break;
+            default: MD5Fixed64(data + 64 * i, single); break;
+            }
+
+            MD_CTX context;
+            MDInit(&context);
+            MDUpdate(&context, data + len * i, len);
+            u8 expected[16];
+            MDFinal(expected, &context);
+
+            if (memcmp(digest[i], expected, 16) != 0 ||
+                memcmp(single, expected, 16) != 0) {
+                failed++;
+            }
+        }
+    }
+
+    printf("MD5 fixed-length test: %s\n", failed ? "failed" : "passed");
+}
+
+/* Encodes digests of assorted byte values with each hex encoder and
+ * checks them against printf. */
+static void MDHexTest() {
+    MD_HEX_KERNEL *hex;
+    const char *name;
+    for (u32 k = 0; (hex = MDHexKernel(k, &name)) != NULL; k++) {
+        u32 failed = 0;
+        for (u32 i = 0; i < 256; i++) {
+            u8 digest[16];
+            char expected[33];
+            for (u32 j = 0; j < 16; j++) {
+                digest[j] = (u8)(i * 31 + j * 17);
+                snprintf(expected + 2 * j, 3, "%02x", digest[j]);
+            }
 
-    u8 buffer[16];
-    i32 len;
-    while ((len = fread(buffer, 1, 16, stdin))) {
-        MDUpdate(&context, buffer, len);
+            char out[32];
+            hex(out, digest);
+            if (memcmp(out, expected, 32) != 0) {
+                failed++;
+            }
+        }
+
+        printf("Hex encoding test (%s): %s\n", name,
+               failed ? "failed" : "passed");
+    }
+}
+
+/* Finds the newlines of buffers of every length up to 300 bytes, at
+ * every alignment and density, a few at a time with each scanner, and
+ * checks them against memchr. */
+static void MDLineTest() {
+    MD_LINE_KERNEL *scan;
+    const char *name;
+    for (u32 k = 0; (scan = MDLineKernel(k, &name)) != NULL; k++) {
+        printf("Line scan test (%s): %s\n", name,
+               MDLineScanTest(scan) ? "failed" : "passed");
+    }
+}
+
+/* Runs the checks of MDLineTest on scan. Returns the number of
+ * failures. */
+static u32 MDLineScanTest(MD_LINE_KERNEL *scan) {
+    u8 data[320];
+    u64 ends[7];
+    u32 failed = 0;
+    for (u32 density = 1; density <= 64; density *= 4) {
+        for (u32 i = 0; i < sizeof(data); i++) {
+            data[i] = ((i * 7919 + density) % (density + 1) == 0) ? '\n' : 'x';
+        }
+        for (u32 off = 0; off < 16; off++) {
+            for (u32 len = 0; len <= 300; len++) {
+                const u8 *p = data + off;
+                u64 from = 0;
+                for (;;) {
+                    u64 n = scan(p + from, len - from, ends, 7);
+                    u64 next = from;
+                    for (u64 k = 0; k < n && !failed; k++) {
+                        const u8 *nl = memchr(p + next, '\n', len - next);
+                        if (nl == NULL || (u64)(nl - p) != from + ends[k]) {
+                            failed++;
+                        }
+                        next = from + ends[k] + 1;
+                    }
+                    if (failed) {
+                        break;
+                    }
+                    if (n < 7) {
+                        failed += (memchr(p + next, '\n', len - next) != NULL);
+                        break;
+                    }
+                    from = next;
+                }
+            }
+        }
+    }
+    return failed;
+}
+
+/* Cuts a fixed pseudo-random buffer with the default chunk sizes and
+ * checks the boundaries against the ones chunk indexes were built with.
+ * Then runs MDChunkIndexTest in a child process, so that the index of
+ * the run, if any, is left alone. */
+static void MDChunkTest() {
+    static const u32 golden[] = {
+        10802, 9177, 11670, 3155,  8654,  8291,  11911, 3646,
+        18816, 11450, 9188, 5224,  8603,  9815,  5859,  8226,
+        15181, 10866, 12293, 16272, 2558, 10739, 10549, 2554,
+        5308,  17212, 2079, 7715,  2481,  1850};
+    static u8 data[256 << 10];
+    u64 x = 0x243f6a8885a308d3;
+    for (u32 i = 0; i < sizeof(data); i++) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        data[i] = (u8)(x >> 24);
+    }
+
+    MD_CHUNKER defaults;
+    u32 failed = (MDChunkerInit(&defaults, CHUNK_MIN, CHUNK_AVG,
+                                CHUNK_MAX) != 0);
+    u32 n = 0;
+    for (u64 off = 0; !failed && off < sizeof(data); n++) {
+        u64 cut = MDChunkCut(&defaults, data + off, sizeof(data) - off);
+        failed += (n >= sizeof(golden) / sizeof(golden[0]) ||
+                   cut != golden[n]);
+        off += cut;
+    }
+    failed += (n != sizeof(golden) / sizeof(golden[0]));
+
+    fflush(stdout);
+    i32 status = -1;
+    pid_t child = fork();
+    if (child == 0) {
+        _exit(MDChunkIndexTest());
+    }
+    if (child > 0) {
+        waitpid(child, &status, 0);
+    }
+    failed += (!WIFEXITED(status) || WEXITSTATUS(status) != 0);
+
+    printf("Chunking test: %s\n", failed ? "failed" : "passed");
+}
+
+/* Adds chunks to an index, saves it, opens it again and adds more, and
+ * checks which chunks each step finds already indexed. Returns the
+ * number of failures. */
+static i32 MDChunkIndexTest() {
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/mdchunk-test.%d", (i32)getpid());
+    u8 digest[4][16];
+    for (u32 i = 0; i < 4; i++) {
+        memset(digest[i], 0, 16);
+        digest[i][0] = (u8)(0x40 * i + 7);
+        digest[i][15] = (u8)i;
+    }
+
+    MDChunkIndexClose();
+    i32 failed = (MDChunkIndexOpen(path) != 0);
+    failed += (MDChunkIndexAdd(digest[0], 100) != 0);
+    failed += (MDChunkIndexAdd(digest[1], 200) != 0);
+    failed += (MDChunkIndexAdd(digest[0], 100) != 1);
+    failed += (MDChunkIndexSave() != 0);
+    MDChunkIndexClose();
+
+    failed += (MDChunkIndexOpen(path) != 0);
+    failed += (MDChunkIndexAdd(digest[1], 200) != 1);
+    failed += (MDChunkIndexAdd(digest[2], 300) != 0);
+    failed += (MDChunkIndexAdd(digest[2], 300) != 1);
+    failed += (MDChunkIndexSave() != 0);
+    MDChunkIndexClose();
+
+    failed += (MDChunkIndexOpen(path) != 0);
+    for (u32 i = 0; i < 3; i++) {
+        failed += (MDChunkIndexAdd(digest[i], 100 * (i + 1)) != 1);
+    }
+    failed += (MDChunkIndexAdd(digest[3], 400) != 0);
+    MDChunkIndexClose();
+    unlink(path);
+    return failed;
+}
+
+/* Checks each CRC32C kernel against the standard check value and, for
+ * buffers of every length up to 300 bytes at every alignment, against a
+ * bitwise CRC, whole and split in two. Checks MDSums against MD5 and
+ * MDCrc32c run separately. */
+static void MDSumsTest() {
+    u8 data[20000];
+    u64 x = 0x9e3779b97f4a7c15;
+    for (u32 i = 0; i < sizeof(data); i++) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        data[i] = (u8)x;
+    }
+
+    MD_CRC_KERNEL *crc32c;
+    const char *name;
+    for (u32 k = 0; (crc32c = MDCrcKernel(k, &name)) != NULL; k++) {
+        printf("CRC32C test (%s): %s\n", name,
+               MDCrcKernelTest(crc32c, data) ? "failed" : "passed");
     }
 
+    MD_SUMS sums;
     u8 digest[16];
+    MD_CTX context;
+    MDSums(&sums, data + 1, sizeof(data) - 1);
+    MDInit(&context);
+    MDUpdate(&context, data + 1, sizeof(data) - 1);
     MDFinal(digest, &context);
+    u32 failed = (memcmp(sums.md5, digest, 16) != 0 ||
+                  sums.crc32c != MDCrc32c(0, data + 1, sizeof(data) - 1) ||
+                  sums.len != sizeof(data) - 1);
+
+    printf("MD5 and CRC32C sums test: %s\n", failed ? "failed" : "passed");
+}
+
+/* Runs the CRC checks of MDSumsTest on crc32c, over the first 308 bytes
+ * of data. Returns the number of failures. */
+static u32 MDCrcKernelTest(MD_CRC_KERNEL *crc32c, const u8 *data) {
+    u32 failed = (~crc32c(~0u, (const u8 *)"123456789", 9) != 0xe3069283);
+    for (u32 off = 0; off < 8; off++) {
+        for (u32 len = 0; len <= 300; len++) {
+            const u8 *p = data + off;
+            u32 crc = 0xffffffff;
+            for (u32 i = 0; i < len; i++) {
+                crc ^= p[i];
+                for (u32 k = 0; k < 8; k++) {
+                    crc = (crc >> 1) ^ (0x82f63b78 & (0 - (crc & 1)));
+                }
+            }
+            u32 half = len / 3;
+            failed += (~crc32c(~0u, p, len) != ~crc);
+            failed += (crc32c(crc32c(~0u, p, half), p + half, len - half) !=
+                       crc);
+        }
+    }
+    return failed;
+}
+
+/* Starts a daemon in a child process and hashes through it with the
+ * client library: messages of several lengths, a pipeline of requests
+ * answered by tag, and a message while another client floods the daemon
+ * without reading its replies. Checks that a message too long to serve
+ * is refused, and that SIGTERM stops the daemon and removes its socket. */
+static void MDServeTest() {
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/mdserve-test.%d", (i32)getpid());
+    u8 *message = malloc(MD_SERVE_MAX_LEN + 1);
+    if (message == NULL) {
+        printf("Daemon test: failed\n");
+        return;
+    }
+    for (u32 i = 0; i <= MD_SERVE_MAX_LEN; i++) {
+        message[i] = (u8)(i * 2654435761u >> 13);
+    }
+
+    fflush(stdout);
+    pid_t daemon = fork();
+    if (daemon == 0) {
+        _exit(MDServe(path, 2, 100000) == 0 ? 0 : 1);
+    }
+    MD_CLIENT *client = NULL;
+    for (u32 i = 0; daemon > 0 && client == NULL && i < 2000; i++) {
+        struct timespec ms = {0, 1000000};
+        if ((client = MDClientOpen(path)) == NULL) {
+            nanosleep(&ms, NULL);
+        }
+    }
+
+    u32 failed = (client == NULL);
+    static const u32 lens[] = {0, 1, 55, 56, 64, 1000, 100000};
+    u8 digest[16], expected[16];
+    MD_CTX context;
+    for (u32 i = 0; client != NULL && i < sizeof(lens) / sizeof(lens[0]);
+         i++) {
+        MDInit(&context);
+        MDUpdate(&context, message, lens[i]);
+        MDFinal(expected, &context);
+        failed += (MDClientHash(client, message, lens[i], digest) != 0 ||
+                   memcmp(digest, expected, 16) != 0);
+    }
+
+    /* Request tag t hashes the first 7 * t bytes. */
+    for (u64 tag = 1; client != NULL && tag <= 32; tag++) {
+        failed += (MDClientSend(client, tag, message, 7 * tag) != 0);
+    }
+    for (u32 i = 0; client != NULL && !failed && i < 32; i++) {
+        u64 tag = 0;
+        if (MDClientReceive(client, &tag, digest) != 0 || tag < 1 ||
+            tag > 32) {
+            failed++;
+            break;
+        }
+        MDInit(&context);
+        MDUpdate(&context, message, 7 * tag);
+        MDFinal(expected, &context);
+        failed += (memcmp(digest, expected, 16) != 0);
+    }
+
+    pid_t flood = -1;
+    if (client != NULL && !failed) {
+        flood = fork();
+        if (flood == 0) {
+            MD_CLIENT *flooder = MDClientOpen(path);
+            while (flooder != NULL &&
+                   MDClientSend(flooder, 0, message, 1024) == 0) {
+            }
+            _exit(0);
+        }
+        struct timespec pause = {0, 300000000};
+        nanosleep(&pause, NULL);
+        MDInit(&context);
+        MDUpdate(&context, message, 64);
+        MDFinal(expected, &context);
+        failed += (MDClientHash(client, message, 64, digest) != 0 ||
+                   memcmp(digest, expected, 16) != 0);
+    }
+    if (flood > 0) {
+        kill(flood, SIGKILL);
+        waitpid(flood, NULL, 0);
+    }
 
-    MDPrint(digest);
-    printf("\n");
+    if (client != NULL) {
+        u64 tag = 0;
+        MDClientSend(client, 99, message, MD_SERVE_MAX_LEN + 1);
+        failed += (MDClientReceive(client, &tag, digest) == 0 || tag != 99);
+        MDClientClose(client);
+    }
+
+    i32 status = -1;
+    if (daemon > 0) {
+        kill(daemon, SIGTERM);
+        waitpid(daemon, &status, 0);
+    }
+    failed += (!WIFEXITED(status) || WEXITSTATUS(status) != 0 ||
+               access(path, F_OK) == 0);
+    free(message);
+
+    printf("Daemon test: %s\n", failed ? "failed" : "passed");
+}
+
+/* Digests a file and prints the result. */
+static void MDFile(char *filename) {
+    if (lineMode) {
+        MDLines(filename);
+        MDOutFlush();
+        return;
+    }
+
+    MD_FILE file;
+    memset(&file, 0, sizeof(file));
+    file.name = filename;
+    MDDigest(&file);
+    MDFileResult(NULL, 0, &file);
+}
+
+/* Prints the result of MDFileDigest. A file that can't be opened or
+ * read makes the exit status fail. */
+static i32 MDFileResult(void *arg, u64 i, MD_FILE *file) {
+    (void)arg;
+    (void)i;
+
+    const char *error = (file->status == FILE_UNREAD) ? "can't be read"
+                                                      : "can't be opened";
+    if (file->status != 0) {
+        exitStatus = 1;
+    }
+    if (file->status != 0 && outputMode == OUT_BINARY) {
+        fprintf(stderr, "%s %s\n", file->name, error);
+    } else if (file->status != 0 && outputMode == OUT_JSON) {
+        MDOutLiteral("{\"file\": ");
+        MDOutJson(file->name);
+        MDOutLiteral(", \"error\": \"");
+        MDOutWrite(error, strlen(error));
+        MDOutLiteral("\"}\n");
+        MDOutEndLine();
+    } else if (file->status != 0) {
+        MDOutWrite(file->name, strlen(file->name));
+        MDOutLiteral(" ");
+        MDOutWrite(error, strlen(error));
+        MDOutLiteral("\n");
+        MDOutEndLine();
+    } else {
+        MDPrintResult("file", file->name, file->digest, file);
+
+        if (reportTimes) {
+            fprintf(stderr, "%s: I/O wait = %.6f s, compute = %.6f s\n",
+                    file->name, file->times.io, file->times.hash);
+        }
+        if (chunking && partLen == 0 && !resume) {
+            totalChunks += file->chunks;
+            totalNew += file->newBytes;
+            totalDuplicate += file->duplicateBytes;
+            if (outputMode != OUT_JSON) {
+                fprintf(stderr,
+                        "%s: %llu chunks, %llu new bytes, "
+                        "%llu duplicate bytes\n",
+                        file->name, (unsigned long long)file->chunks,
+                        (unsigned long long)file->newBytes,
+                        (unsigned long long)file->duplicateBytes);
+            }
+        }
+    }
+    return 0;
+}
+
+/* Digests files and prints the results in order. With -r, directories
+ * are replaced by the files below them. */
+static void MDFiles(char **filename, u64 files) {
+    if (lineMode) {
+        for (u64 i = 0; i < files; i++) {
+            MDLines(filename[i]);
+        }
+        MDOutFlush();
+        return;
+    }
+    if (!recursive) {
+        MDFilesFlat(filename, files, MDFileResult, NULL);
+        MDOutFlush();
+        return;
+    }
+
+    u64 first = 0;
+    for (u64 i = 0; i < files; i++) {
+        struct stat st;
+        if (stat(filename[i], &st) == 0 && S_ISDIR(st.st_mode)) {
+            MDFilesFlat(filename + first, i - first, MDFileResult, NULL);
+            MDTree(filename[i]);
+            first = i + 1;
+        }
+    }
+    MDFilesFlat(filename + first, files - first, MDFileResult, NULL);
+    MDOutFlush();
+}
+
+/* Digests files on the -j workers and reports the results in order,
+ * until report asks to stop. Returns nonzero if it did. With -p, files
+ * are taken one at a time and the workers share out their parts. */
+static i32 MDFilesFlat(char **filename, u64 files, MD_REPORT report,
+                       void *arg) {
+    if (threads <= 1 || partLen != 0) {
+        for (u64 i = 0; i < files; i++) {
+            MD_FILE file;
+            memset(&file, 0, sizeof(file));
+            file.name = filename[i];
+            MDDigest(&file);
+            if (report(arg, i, &file)) {
+                return 1;
+            }
+        }
+        return 0;
+    }
+
+    for (u64 first = 0; first < files; first += WINDOW_FILES) {
+        u64 left = files - first;
+        if (MDFilesWindow(filename, first,
+                          (left < WINDOW_FILES) ? left : WINDOW_FILES, report,
+                          arg)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Digests up to WINDOW_FILES files, filename[first] onwards, in
+ * parallel. The files are stat'ed in parallel first, then cut into
+ * batches: a large file alone, small consecutive files together. Batches
+ * go to the pool largest first, dealt round-robin over the workers.
+ * Results are reported in order as they complete; once report asks to
+ * stop, files not yet started are skipped. Returns nonzero if report
+ * asked to stop. */
+static i32 MDFilesWindow(char **filename, u64 first, u64 files,
+                         MD_REPORT report, void *arg) {
+    MD_RUN run;
+    run.file = calloc(files, sizeof(*run.file));
+    run.batch = malloc(files * sizeof(*run.batch));
+    MD_BATCH *sorted = malloc(files * sizeof(*sorted));
+    if (run.file == NULL || run.batch == NULL || sorted == NULL) {
+        free(run.file);
+        free(run.batch);
+        free(sorted);
+        for (u64 i = 0; i < files; i++) {
+            MD_FILE file;
+            memset(&file, 0, sizeof(file));
+            file.name = filename[first + i];
+            MDDigest(&file);
+            if (report(arg, first + i, &file)) {
+                return 1;
+            }
+        }
+        return 0;
+    }
+    run.files = files;
+    run.stop = 0;
+    pthread_mutex_init(&run.lock, NULL);
+    pthread_cond_init(&run.cond, NULL);
+
+    for (u64 i = 0; i < files; i++) {
+        run.file[i].name = filename[first + i];
+    }
+    MDPoolRun(threads, (files + BATCH_FILES - 1) / BATCH_FILES, MDStatTask,
+              &run);
+
+    u64 batches = 0;
+    MD_BATCH *last = NULL;
+    for (u64 i = 0; i < files; i++) {
+        u64 size = run.file[i].size;
+        if (last == NULL || size >= LARGE_FILE_LEN ||
+            last->count == BATCH_FILES || last->bytes + size > BATCH_LEN) {
+            last = &sorted[batches++];
+            last->first = i;
+            last->count = 0;
+            last->bytes = 0;
+        }
+        last->count++;
+        last->bytes += size;
+    }
+    qsort(sorted, batches, sizeof(*sorted), CompareBatches);
+
+    /* MDPoolStart gives worker w the range [batches * w / threads,
+     * batches * (w + 1) / threads); deal the sorted batches into those
+     * ranges in turn. */
+    u64 fill[threads];
+    for (u32 w = 0; w < threads; w++) {
+        fill[w] = batches * w / threads;
+    }
+    for (u64 p = 0, w = 0; p < batches; p++, w = (w + 1) % threads) {
+        while (fill[w] == batches * (w + 1) / threads) {
+            w = (w + 1) % threads;
+        }
+        run.batch[fill[w]++] = sorted[p];
+    }
+    run.batches = batches;
+    free(sorted);
+
+    MD_POOL *pool = MDPoolStart(threads, batches, MDHashTask, &run);
+    for (u64 i = 0; i < files && !run.stop; i++) {
+        MD_FILE *file = &run.file[i];
+        pthread_mutex_lock(&run.lock);
+        while (!file->done) {
+            pthread_cond_wait(&run.cond, &run.lock);
+        }
+        pthread_mutex_unlock(&run.lock);
+
+        if (report(arg, first + i, file)) {
+            __atomic_store_n(&run.stop, 1, __ATOMIC_RELAXED);
+        }
+    }
+    MDPoolWait(pool);
+
+    pthread_cond_destroy(&run.cond);
+    pthread_mutex_destroy(&run.lock);
+    free(run.file);
+    free(run.batch);
+    return run.stop;
 }
 
-/* Prints a message digest in hexadecimal. */
-static void MDPrint(u8 digest[16]) {
-    for (u8 i = 0; i < 16; i++) {
-        printf("%02x", digest[i]);
+/* Digests the files below directory root, in path order. Each level of
+ * the tree is listed in parallel on the -j workers. Symbolic links to
+ * directories are not followed. */
+static void MDTree(char *root) {
+    MD_WALK walk;
+    memset(&walk, 0, sizeof(walk));
+    pthread_mutex_init(&walk.lock, NULL);
+
+    char *top = strdup(root);
+    walk.dir = &top;
+    walk.dirs = (top != NULL);
+    while (walk.dirs > 0) {
+        MDPoolRun(threads, walk.dirs, MDWalkTask, &walk);
+
+        for (u64 i = 0; i < walk.dirs; i++) {
+            free(walk.dir[i]);
+        }
+        if (walk.dir != &top) {
+            free(walk.dir);
+        }
+        walk.dir = walk.next;
+        walk.dirs = walk.nexts;
+        walk.next = NULL;
+        walk.nexts = walk.nextSize = 0;
+    }
+    free(walk.dir);
+
+    qsort(walk.file, walk.files, sizeof(*walk.file), ComparePaths);
+    MDFilesFlat(walk.file, walk.files, MDFileResult, NULL);
+
+    for (u64 i = 0; i < walk.files; i++) {
+        free(walk.file[i]);
+    }
+    free(walk.file);
+    pthread_mutex_destroy(&walk.lock);
+}
+
+/* Pool task: lists the i-th directory of the current level. A directory
+ * that can't be listed is passed on as a file, so that it is reported
+ * like any file that can't be opened. */
+static void MDWalkTask(void *arg, u64 i) {
+    MD_WALK *walk = arg;
+    char *dir = walk->dir[i];
+
+    DIR *d = opendir(dir);
+    if (d == NULL) {
+        pthread_mutex_lock(&walk->lock);
+        MDAppend(&walk->file, &walk->files, &walk->fileSize, strdup(dir));
+        pthread_mutex_unlock(&walk->lock);
+        return;
+    }
+
+    size_t dirLen = strlen(dir);
+    const char *sep = (dirLen > 0 && dir[dirLen - 1] == '/') ? "" : "/";
+
+    struct dirent *e;
+    while ((e = readdir(d)) != NULL) {
+        if (strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0) {
+            continue;
+        }
+
+        size_t len = dirLen + strlen(sep) + strlen(e->d_name) + 1;
+        char *path = malloc(len);
+        if (path == NULL) {
+            continue;
+        }
+        snprintf(path, len, "%s%s%s", dir, sep, e->d_name);
+
+        /* Without a usable d_type, lstat tells directories (but not
+         * links to them) apart; links and others are followed by stat. */
+        i32 isDir = (e->d_type == DT_DIR), isFile = (e->d_type == DT_REG);
+        struct stat st;
+        if (e->d_type == DT_UNKNOWN && lstat(path, &st) == 0) {
+            isDir = S_ISDIR(st.st_mode);
+        }
+        if (!isDir && !isFile && stat(path, &st) == 0) {
+            isFile = S_ISREG(st.st_mode);
+        }
+
+        pthread_mutex_lock(&walk->lock);
+        i32 added = 0;
+        if (isDir) {
+            added = MDAppend(&walk->next, &walk->nexts, &walk->nextSize, path);
+        } else if (isFile) {
+            added = MDAppend(&walk->file, &walk->files, &walk->fileSize, path);
+        }
+        pthread_mutex_unlock(&walk->lock);
+        if (!added) {
+            free(path);
+        }
+    }
+    closedir(d);
+}
+
+/* Appends path to a growing array. Returns 0 if it can't grow. */
+static i32 MDAppend(char ***array, u64 *count, u64 *size, char *path) {
+    if (path == NULL) {
+        return 0;
+    }
+    if (*count == *size) {
+        u64 grown = *size ? 2 * *size : 256;
+        char **resized = realloc(*array, grown * sizeof(**array));
+        if (resized == NULL) {
+            return 0;
+        }
+        *array = resized;
+        *size = grown;
+    }
+    (*array)[(*count)++] = path;
+    return 1;
+}
+
+/* Orders paths bytewise. */
+static i32 ComparePaths(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/* Pool task: stats the i-th group of BATCH_FILES files of a run. */
+static void MDStatTask(void *arg, u64 i) {
+    MD_RUN *run = arg;
+    u64 end = (i + 1) * BATCH_FILES;
+    for (u64 f = i * BATCH_FILES; f < end && f < run->files; f++) {
+        struct stat st;
+        if (stat(run->file[f].name, &st) == 0 && S_ISREG(st.st_mode)) {
+            run->file[f].size = st.st_size;
+        }
+    }
+}
+
+/* Pool task: digests the files of the i-th batch of a run. */
+static void MDHashTask(void *arg, u64 i) {
+    MD_RUN *run = arg;
+    MD_BATCH *batch = &run->batch[i];
+    for (u64 f = batch->first; f < batch->first + batch->count; f++) {
+        MD_FILE *file = &run->file[f];
+        if (__atomic_load_n(&run->stop, __ATOMIC_RELAXED)) {
+            file->status = FILE_UNOPENED;
+        } else {
+            MDDigest(file);
+        }
+
+        pthread_mutex_lock(&run->lock);
+        file->done = 1;
+        pthread_cond_broadcast(&run->cond);
+        pthread_mutex_unlock(&run->lock);
+    }
+}
+
+/* Orders MD_BATCHes by descending size. */
+static i32 CompareBatches(const void *a, const void *b) {
+    u64 x = ((const MD_BATCH *)a)->bytes, y = ((const MD_BATCH *)b)->bytes;
+    return (x < y) - (x > y);
+}
+
+/* Digests the named file, into a multipart digest with -p, from its
+ * checkpoint with -u, or whole; chunk by chunk with -d, and along with
+ * its CRC32C and length with -m. */
+static void MDDigest(MD_FILE *file) {
+    if (partLen != 0) {
+        file->status = MDPartsDigest(file->name, file->digest, &file->parts,
+                                     &file->times);
+    } else if (resume) {
+        file->status = MDResumeDigest(file);
+    } else {
+        file->status = MDFileDigest(file);
+    }
+    MDStatsFile(file->status, file->times.io, file->times.hash);
+}
+
+/* Digests a file into file->digest, adding the time spent to
+ * file->times. With -d the data passes through the chunking stage on
+ * its way to the digest; with -m the digest comes with the CRC32C and
+ * length, into file, from the same spans. Non-empty regular files are
+ * memory-mapped; anything else, or a file that can't be mapped, is
+ * read. With -C, regular files whose metadata matches the cache are not
+ * read at all, except for the sample checked by --verify-cache. With -d
+ * or -m every file is read for its chunks or CRC, and a cache hit is
+ * checked like a sampled one. Returns FILE_UNOPENED if the file can't
+ * be opened, or FILE_UNREAD, with nothing cached, on a read error. */
+static i32 MDFileDigest(MD_FILE *file) {
+    i32 fd = open(file->name, O_RDONLY);
+    if (fd < 0) {
+        return FILE_UNOPENED;
+    }
+
+    struct stat st;
+    i32 regular = (fstat(fd, &st) == 0 && S_ISREG(st.st_mode));
+
+    u8 cached[16];
+    i32 hit = 0;
+    if (useCache && regular && MDCacheLookup(&st, cached)) {
+        /* Sample by inode, salted per process so that every run checks
+         * different files. */
+        u64 h = ((u64)st.st_ino ^ verifySalt) * 0xff51afd7ed558ccd;
+        if (!chunking && !multiDigest && (h >> 32) % 100 >= verifyPercent) {
+            memcpy(file->digest, cached, 16);
+            MD_COUNT(cached, 1);
+            close(fd);
+            return 0;
+        }
+        hit = 1;
+    }
+
+    MD_CTX context;
+    MD_SUMS_CTX sums;
+    MD_SINK hash = {MDContextSpan, &context};
+    if (multiDigest) {
+        MDSumsInit(&sums);
+        hash.span = MDSumsSpan;
+        hash.arg = &sums;
+    } else {
+        MDInit(&context);
+    }
+    MD_SINK sink = hash;
+    MD_CHUNKS chunks;
+    if (chunking && MDChunksInit(&chunks, &hash, file) == 0) {
+        sink.span = MDChunksSpan;
+        sink.arg = &chunks;
+    }
+
+    i32 status = 0;
+    if (!useMap || !regular || st.st_size == 0 ||
+        MDMapUpdate(&sink, fd, st.st_size, &file->times) != 0) {
+        status = MDReadUpdate(&sink, fd, &file->times);
+    }
+    if (sink.arg == &chunks) {
+        double start = MDNow();
+        MDChunksEnd(&chunks);
+        file->times.hash += MDNow() - start;
+    }
+
+    if (multiDigest) {
+        MD_SUMS result;
+        MDSumsFinal(&result, &sums);
+        memcpy(file->digest, result.md5, 16);
+        file->crc32c = result.crc32c;
+        file->len = result.len;
+        file->hasSums = 1;
+    } else {
+        MDFinal(file->digest, &context);
+    }
+    close(fd);
+    if (status != 0) {
+        return FILE_UNREAD;
+    }
+
+    if (hit && memcmp(file->digest, cached, 16) != 0) {
+        fprintf(stderr, "%s: stale cache entry\n", file->name);
+        __atomic_add_fetch(&staleEntries, 1, __ATOMIC_RELAXED);
+        hit = 0;
+    }
+    if (useCache && regular && !hit) {
+        MDCacheStore(&st, file->digest);
+    }
+    return 0;
+}
+
+/* Digests a file into a multipart digest of partLen-byte parts, and
+ * the number of parts into parts. Non-empty regular files are mapped and
+ * their parts digested on the -j workers, each several parts at a time
+ * in SIMD lanes; anything else is read one part after another. The
+ * cache is not used. A file of one part gets the digest of that part,
+ * as S3 gives for a single-part upload. Returns FILE_UNOPENED if the
+ * file can't be opened, or FILE_UNREAD on a read error. */
+static i32 MDPartsDigest(char *filename, u8 digest[16], u64 *parts,
+                         MD_TIMES *times) {
+    i32 fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        return FILE_UNOPENED;
+    }
+
+    struct stat st;
+    MD_PARTS job;
+    job.data = MAP_FAILED;
+    if (useMap && fstat(fd, &st) == 0 && S_ISREG(st.st_mode) &&
+        st.st_size > 0 && (u64)st.st_size == (size_t)st.st_size) {
+        job.size = st.st_size;
+        job.parts = (job.size - 1) / partLen + 1;
+        job.digest = malloc(job.parts * sizeof(*job.digest));
+        if (job.digest != NULL) {
+            job.data = mmap(NULL, job.size, PROT_READ, MAP_PRIVATE, fd, 0);
+        }
+        if (job.data == MAP_FAILED) {
+            free(job.digest);
+        }
+    }
+
+    if (job.data != MAP_FAILED) {
+        madvise(job.data, job.size, MADV_SEQUENTIAL);
+#ifdef MADV_HUGEPAGE
+        madvise(job.data, job.size, MADV_HUGEPAGE);
+#endif
+
+        /* Enough parts per task to fill the lanes, but no fewer tasks
+         * than workers while there are parts to go round. */
+        u64 perWorker = (job.parts - 1) / threads + 1;
+        job.group = (perWorker < MD5MaxLanes()) ? perWorker : MD5MaxLanes();
+
+        double start = MDNow();
+        MDPoolRun(threads, (job.parts - 1) / job.group + 1, MDPartTask, &job);
+        times->hash += MDNow() - start;
+        MD_COUNT(mapped, 1);
+        munmap(job.data, job.size);
+    } else {
+        u8 fallback[1024];
+        u8 *buffer = MDAlloc(readBufferLen);
+        u32 bufferLen = readBufferLen;
+        if (buffer == NULL) {
+            buffer = fallback;
+            bufferLen = sizeof(fallback);
+        }
+
+        /* A part that gets no data ends the file, unless it is the
+         * first: an empty file is one empty part. */
+        u64 size = 0;
+        ssize_t len = 1;
+        job.parts = 0;
+        job.digest = NULL;
+        while (len > 0) {
+            MD_CTX context;
+            MDInit(&context);
+            u64 left = partLen;
+            while (left > 0) {
+                double start = MDNow();
+                len = MDReadFull(fd, buffer, (left < bufferLen) ? left
+                                                                : bufferLen);
+                double read = MDNow();
+                times->io += read - start;
+                if (len <= 0) {
+                    break;
+                }
+                MD_COUNT(refills, 1);
+
+                MDUpdate(&context, buffer, len);
+                left -= len;
+                times->hash += MDNow() - read;
+            }
+            if (len < 0 || (left == partLen && job.parts > 0)) {
+                break;
+            }
+
+            if (job.parts == size) {
+                size = size ? 2 * size : 64;
+                u8(*grown)[16] = realloc(job.digest, size * 16);
+                if (grown == NULL) {
+                    free(job.digest);
+                    job.digest = NULL;
+                    break;
+                }
+                job.digest = grown;
+            }
+            MDFinal(job.digest[job.parts++], &context);
+        }
+
+        if (buffer != fallback) {
+            free(buffer);
+        }
+        if (len < 0 || job.digest == NULL) {
+            free(job.digest);
+            close(fd);
+            return FILE_UNREAD;
+        }
+    }
+    close(fd);
+
+    if (job.parts == 1) {
+        memcpy(digest, job.digest[0], 16);
+    } else {
+        MD5Multipart(digest, job.digest, job.parts);
+    }
+    *parts = job.parts;
+    free(job.digest);
+    return 0;
+}
+
+/* Digests a regular file from its checkpoint, reading only the data
+ * appended since, and checkpoints it again. Without a usable checkpoint
+ * the whole file is read. Anything but a regular file is digested as
+ * usual. Returns FILE_UNOPENED if the file can't be opened, or
+ * FILE_UNREAD, with the checkpoint left as it was, on a read error. */
+static i32 MDResumeDigest(MD_FILE *file) {
+    i32 fd = open(file->name, O_RDONLY);
+    if (fd < 0) {
+        return FILE_UNOPENED;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return MDFileDigest(file);
+    }
+
+    MD_CTX context;
+    if (MDLoadCheckpoint(file->name, fd, &st, &context) != 0) {
+        MDInit(&context);
+    }
+    MD_SINK sink = {MDContextSpan, &context};
+    i32 status = MDReadUpdate(&sink, fd, &file->times);
+
+    MD_CTX final = context;
+    MDFinal(file->digest, &final);
+    if (status == 0 && MDSaveCheckpoint(file->name, fd, &st, &context) != 0) {
+        fprintf(stderr, "%s checkpoint can't be written\n", file->name);
+    }
+
+    memset(&context, 0, sizeof(context));
+    close(fd);
+    return (status == 0) ? 0 : FILE_UNREAD;
+}
+
+/* Restores context from the checkpoint of filename and seeks fd to the
+ * end of the data it covers. Returns -1 if there is no checkpoint, or it
+ * is for another file or data that has changed. */
+static i32 MDLoadCheckpoint(char *filename, i32 fd, struct stat *st,
+                            MD_CTX *context) {
+    char *name = MDCheckpointName(filename, "");
+    if (name == NULL) {
+        return -1;
+    }
+    i32 cfd = open(name, O_RDONLY);
+    free(name);
+    if (cfd < 0) {
+        return -1;
+    }
+    u8 checkpoint[CHECKPOINT_LEN + 1];
+    ssize_t len = MDReadFull(cfd, checkpoint, sizeof(checkpoint));
+    close(cfd);
+
+    MD_CTX saved;
+    if (len != CHECKPOINT_LEN || MD5Import(&saved, checkpoint) != 0) {
+        return -1;
+    }
+
+    u64 ino = 0;
+    for (u32 i = 0; i < 8; i++) {
+        ino |= (u64)checkpoint[MD5_EXPORT_LEN + i] << (8 * i);
+    }
+    u64 offset = saved.count >> 3;
+    u8 tail[16];
+    if (ino != (u64)st->st_ino || offset > (u64)st->st_size ||
+        MDTailDigest(fd, offset, tail) != 0 ||
+        memcmp(tail, checkpoint + MD5_EXPORT_LEN + 8, 16) != 0 ||
+        lseek(fd, offset, SEEK_SET) != (off_t)offset) {
+        return -1;
+    }
+
+    *context = saved;
+    return 0;
+}
+
+/* Writes the checkpoint of filename for context, which has digested fd
+ * up to its current length. The checkpoint is replaced atomically.
+ * Returns -1 on failure. */
+static i32 MDSaveCheckpoint(char *filename, i32 fd, struct stat *st,
+                            MD_CTX *context) {
+    u8 checkpoint[CHECKPOINT_LEN];
+    MD5Export(checkpoint, context);
+    for (u32 i = 0; i < 8; i++) {
+        checkpoint[MD5_EXPORT_LEN + i] = (u8)((u64)st->st_ino >> (8 * i));
+    }
+    u64 offset = context->count >> 3;
+    if (MDTailDigest(fd, offset, checkpoint + MD5_EXPORT_LEN + 8) != 0) {
+        return -1;
+    }
+
+    char *name = MDCheckpointName(filename, "");
+    char *tmp = MDCheckpointName(filename, ".tmp");
+    i32 status = -1;
+    if (name != NULL && tmp != NULL) {
+        i32 cfd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (cfd >= 0) {
+            ssize_t len = write(cfd, checkpoint, sizeof(checkpoint));
+            if (close(cfd) == 0 && len == (ssize_t)sizeof(checkpoint) &&
+                rename(tmp, name) == 0) {
+                status = 0;
+            } else {
+                unlink(tmp);
+            }
+        }
+    }
+    free(name);
+    free(tmp);
+    return status;
+}
+
+/* Digests the CHECKPOINT_TAIL bytes of fd before offset (fewer if
+ * offset is smaller) into digest. Returns -1 if they can't be read. */
+static i32 MDTailDigest(i32 fd, u64 offset, u8 digest[16]) {
+    u8 tail[CHECKPOINT_TAIL];
+    u32 len = (offset < CHECKPOINT_TAIL) ? (u32)offset : CHECKPOINT_TAIL;
+    for (u32 done = 0; done < len;) {
+        ssize_t n = pread(fd, tail + done, len - done, offset - len + done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        done += n;
+    }
+
+    MD_CTX context;
+    MDInit(&context);
+    MDUpdate(&context, tail, len);
+    MDFinal(digest, &context);
+    return 0;
+}
+
+/* Returns the name of the checkpoint of filename, plus suffix, in
+ * allocated memory, or NULL. */
+static char *MDCheckpointName(char *filename, const char *suffix) {
+    size_t len = strlen(filename) + strlen(CHECKPOINT_SUFFIX) +
+                 strlen(suffix) + 1;
+    char *name = malloc(len);
+    if (name != NULL) {
+        snprintf(name, len, "%s%s%s", filename, CHECKPOINT_SUFFIX, suffix);
+    }
+    return name;
+}
+
+/* Pool task: digests the i-th group of parts of an MD_PARTS job. */
+static void MDPartTask(void *arg, u64 i) {
+    MD_PARTS *job = arg;
+    u64 first = i * job->group;
+    u64 offset = first * partLen;
+    u64 len = job->group * partLen;
+    if (len > job->size - offset) {
+        len = job->size - offset;
+    }
+    MD5Parts(job->data + offset, len, partLen, job->digest + first);
+}
+
+/* Sink of a plain digest: adds a span to the context at arg. */
+static void MDContextSpan(void *arg, const u8 *data, u64 len) {
+    MDUpdate(arg, data, len);
+}
+
+/* Sink of -m: adds a span to the MD_SUMS_CTX at arg, which feeds it to
+ * MD5 and CRC32C a cache-sized slice at a time. */
+static void MDSumsSpan(void *arg, const u8 *data, u64 len) {
+    MDSumsUpdate(arg, data, len);
+}
+
+/* Digests size bytes of fd through a read-only mapping, in one update
+ * of the whole region; the kernel reads ahead of the sequential access.
+ * Page faults count as compute time. Returns -1, with sink untouched,
+ * if fd can't be mapped. */
+static i32 MDMapUpdate(MD_SINK *sink, i32 fd, u64 size, MD_TIMES *times) {
+    if (size != (size_t)size) {
+        return -1;
+    }
+
+    u8 *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+
+    madvise(map, size, MADV_SEQUENTIAL);
+#ifdef MADV_HUGEPAGE
+    madvise(map, size, MADV_HUGEPAGE);
+#endif
+
+    double start = MDNow();
+    sink->span(sink->arg, map, size);
+    times->hash += MDNow() - start;
+    MD_COUNT(mapped, 1);
+
+    munmap(map, size);
+    return 0;
+}
+
+/* Digests each line of the named file, or of standard input for "-",
+ * and prints the digests in order. A line is a record up to, but not
+ * including, a newline; a last line without one is a record too.
+ * Non-empty regular files are mapped; anything else is read through a
+ * buffer that grows to hold the longest record. */
+static void MDLines(char *filename) {
+    lineInputs++;
+    i32 fd = (strcmp(filename, "-") == 0) ? STDIN_FILENO
+                                           : open(filename, O_RDONLY);
+    MD_LINES *lines = (fd >= 0) ? malloc(sizeof(*lines)) : NULL;
+    if (lines == NULL) {
+        MD_FILE file;
+        memset(&file, 0, sizeof(file));
+        file.name = filename;
+        file.status = FILE_UNOPENED;
+        MDFileResult(NULL, 0, &file);
+        if (fd > STDIN_FILENO) {
+            close(fd);
+        }
+        return;
+    }
+
+    struct stat st;
+    u8 *map = MAP_FAILED;
+    i32 status = 0;
+    if (useMap && fstat(fd, &st) == 0 && S_ISREG(st.st_mode) &&
+        st.st_size > 0 && (u64)st.st_size == (size_t)st.st_size &&
+        lseek(fd, 0, SEEK_CUR) == 0) {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+
+    if (map != MAP_FAILED) {
+        madvise(map, st.st_size, MADV_SEQUENTIAL);
+        MDLineSpan(lines, map, st.st_size, 0, 1);
+        munmap(map, st.st_size);
+    } else {
+        u64 size = readBufferLen;
+        u8 *buffer = MDAlloc(size);
+        u64 have = 0;
+        u64 base = 0;
+        i32 end = (buffer == NULL);
+        while (!end) {
+            if (have == size) {
+                /* A record fills the buffer. */
+                u8 *grown = MDAlloc(2 * size);
+                if (grown == NULL) {
+                    fprintf(stderr, "%s: line too long\n", filename);
+                    break;
+                }
+                memcpy(grown, buffer, have);
+                free(buffer);
+                buffer = grown;
+                size *= 2;
+            }
+
+            u64 want = (size - have < (1 << 30)) ? size - have : (1 << 30);
+            ssize_t len = MDReadFull(fd, buffer + have, (u32)want);
+            if (len < 0) {
+                /* The record being read is incomplete; leave it out. */
+                status = FILE_UNREAD;
+                break;
+            }
+            end = (len < (ssize_t)want);
+            have += (u64)len;
+
+            u64 used = MDLineSpan(lines, buffer, have, base, end);
+            memmove(buffer, buffer + used, have - used);
+            have -= used;
+            base += used;
+        }
+        free(buffer);
+    }
+
+    free(lines);
+    if (fd > STDIN_FILENO) {
+        close(fd);
+    }
+    if (status != 0) {
+        MD_FILE file;
+        memset(&file, 0, sizeof(file));
+        file.name = filename;
+        file.status = status;
+        MDFileResult(NULL, 0, &file);
+    }
+}
+
+/* Digests the records in the len bytes at data, found at offset base of
+ * the input, and prints their digests, a window at a time. Unless final
+ * is set, a last record without a newline is left over. Returns the
+ * number of bytes used. */
+static u64 MDLineSpan(MD_LINES *lines, const u8 *data, u64 len, u64 base,
+                      i32 final) {
+    u64 used = 0;
+    for (;;) {
+        u64 n = MDLineEnds(data + used, len - used, lines->end, LINE_WINDOW);
+        u64 start = used;
+        for (u64 i = 0; i < n; i++) {
+            u64 end = used + lines->end[i];
+            lines->input[i] = data + start;
+            lines->len[i] = end - start;
+            start = end + 1;
+        }
+        if (n < LINE_WINDOW && final && start < len) {
+            lines->input[n] = data + start;
+            lines->len[n++] = len - start;
+            start = len;
+        }
+        if (n == 0) {
+            return used;
+        }
+
+        lines->records = n;
+        u64 groups = (n - 1) / LINE_GROUP + 1;
+        if (threads > 1 && groups > 1) {
+            MDPoolRun(threads, groups, MDLineTask, lines);
+        } else {
+            for (u64 g = 0; g < groups; g++) {
+                MDLineTask(lines, g);
+            }
+        }
+        for (u64 i = 0; i < n; i++) {
+            MDPrintLine(lines->digest[i], base + (lines->input[i] - data));
+        }
+
+        used = start;
+        if (n < LINE_WINDOW) {
+            return used;
+        }
+    }
+}
+
+/* Pool task: digests the i-th group of LINE_GROUP records of a window. */
+static void MDLineTask(void *arg, u64 i) {
+    MD_LINES *lines = arg;
+    u64 first = i * LINE_GROUP;
+    u64 count = lines->records - first;
+    if (count > LINE_GROUP) {
+        count = LINE_GROUP;
+    }
+    MD5Batch(lines->input + first, lines->len + first, lines->digest + first,
+             count);
+}
+
+/* Sets up chunks to chunk the spans of file on their way to next.
+ * Returns -1 without memory for the carry. */
+static i32 MDChunksInit(MD_CHUNKS *chunks, MD_SINK *next, MD_FILE *file) {
+    chunks->next = next;
+    chunks->file = file;
+    chunks->have = 0;
+    chunks->size = 2 * chunker.max;
+    chunks->carry = malloc(chunks->size);
+    return (chunks->carry != NULL) ? 0 : -1;
+}
+
+/* Sink of the chunking stage. The chunk waiting in the carry is first
+ * completed from the front of data; if data ends before the carry
+ * fills, all of it waits. Otherwise the carry, two of the largest
+ * chunks long, is chunked past what it held before, and the rest of
+ * data is chunked in place. Boundaries are the same wherever the spans
+ * split the file. */
+static void MDChunksSpan(void *arg, const u8 *data, u64 len) {
+    MD_CHUNKS *chunks = arg;
+    if (chunks->have > 0) {
+        u64 take = chunks->size - chunks->have;
+        if (take > len) {
+            take = len;
+        }
+        memcpy(chunks->carry + chunks->have, data, take);
+        u64 used = MDChunkSpan(chunks, chunks->carry, chunks->have + take, 0);
+        if (take == len) {
+            chunks->have += take - used;
+            memmove(chunks->carry, chunks->carry + used, chunks->have);
+            return;
+        }
+        data += used - chunks->have;
+        len -= used - chunks->have;
+        chunks->have = 0;
+    }
+
+    u64 used = MDChunkSpan(chunks, data, len, 0);
+    chunks->have = len - used;
+    memcpy(chunks->carry, data + used, chunks->have);
+}
+
+/* Chunks what waits in the carry as the end of the file, and frees the
+ * carry. */
+static void MDChunksEnd(MD_CHUNKS *chunks) {
+    MDChunkSpan(chunks, chunks->carry, chunks->have, 1);
+    free(chunks->carry);
+}
+
+/* Cuts the len bytes at data into chunks and digests them CHUNK_BATCH
+ * at a time with MD5Batch, passing the bytes on to the next sink and
+ * adding the chunks to the chunk index. Unless final is set, a last
+ * chunk that may go on past len is left over, shorter than the largest
+ * chunk. Returns the number of bytes chunked. */
+static u64 MDChunkSpan(MD_CHUNKS *chunks, const u8 *data, u64 len,
+                       i32 final) {
+    MD_FILE *file = chunks->file;
+    const u8 *chunk[CHUNK_BATCH];
+    u64 chunkLen[CHUNK_BATCH];
+    u8 digest[CHUNK_BATCH][16];
+
+    u64 used = 0;
+    for (;;) {
+        u64 first = used;
+        u32 n = 0;
+        while (n < CHUNK_BATCH && used < len) {
+            u64 cut = MDChunkCut(&chunker, data + used, len - used);
+            if (!final && cut == len - used && cut < chunker.max) {
+                break;
+            }
+            chunk[n] = data + used;
+            chunkLen[n++] = cut;
+            used += cut;
+        }
+        if (n == 0) {
+            return used;
+        }
+
+        MD5Batch(chunk, chunkLen, digest, n);
+        chunks->next->span(chunks->next->arg, data + first, used - first);
+        for (u32 i = 0; i < n; i++) {
+            if (MDChunkIndexAdd(digest[i], chunkLen[i])) {
+                file->duplicateBytes += chunkLen[i];
+            } else {
+                file->newBytes += chunkLen[i];
+            }
+        }
+        file->chunks += n;
+    }
+}
+
+/* Digests fd up to end of file or the first read error, through
+ * buffers of readBufferLen bytes. With more than one buffer, a reader
+ * thread fills them ahead of the hashing. Returns -1 if reading stopped
+ * at an error, so that the data passed to sink is incomplete. */
+static i32 MDReadUpdate(MD_SINK *sink, i32 fd, MD_TIMES *times) {
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+    i32 failed = 0;
+    if (readBuffers > 1 && MDRingUpdate(sink, fd, times, &failed) == 0) {
+        return failed ? -1 : 0;
+    }
+
+    u8 fallback[1024];
+    u8 *buffer = MDAlloc(readBufferLen);
+    u32 bufferLen = readBufferLen;
+    if (buffer == NULL) {
+        buffer = fallback;
+        bufferLen = sizeof(fallback);
+    }
+
+    for (;;) {
+        double start = MDNow();
+        ssize_t len = MDReadFull(fd, buffer, bufferLen);
+        double read = MDNow();
+        times->io += read - start;
+        if (len <= 0) {
+            failed = (len < 0);
+            break;
+        }
+        MD_COUNT(refills, 1);
+
+        sink->span(sink->arg, buffer, len);
+        times->hash += MDNow() - read;
+    }
+
+    if (buffer != fallback) {
+        free(buffer);
+    }
+    return failed ? -1 : 0;
+}
+
+/* Digests fd through a ring of readBuffers buffers filled by a reader
+ * thread, setting failed if reading stopped at an error. Returns -1,
+ * with sink untouched, if the ring or the thread can't be set up. */
+static i32 MDRingUpdate(MD_SINK *sink, i32 fd, MD_TIMES *times,
+                        i32 *failed) {
+    MD_RING ring;
+    ring.fd = fd;
+    ring.count = readBuffers;
+    ring.size = readBufferLen;
+    ring.filled = ring.consumed = 0;
+    if ((ring.data = MDAlloc((size_t)ring.count * ring.size)) == NULL) {
+        return -1;
+    }
+    pthread_mutex_init(&ring.lock, NULL);
+    pthread_cond_init(&ring.cond, NULL);
+
+    pthread_t reader;
+    if (pthread_create(&reader, NULL, MDReadAhead, &ring) != 0) {
+        pthread_cond_destroy(&ring.cond);
+        pthread_mutex_destroy(&ring.lock);
+        free(ring.data);
+        return -1;
+    }
+
+    for (;;) {
+        double start = MDNow();
+        pthread_mutex_lock(&ring.lock);
+        while (ring.filled == ring.consumed) {
+            pthread_cond_wait(&ring.cond, &ring.lock);
+        }
+        pthread_mutex_unlock(&ring.lock);
+        double ready = MDNow();
+        times->io += ready - start;
+
+        u32 slot = ring.consumed % ring.count;
+        ssize_t len = ring.len[slot];
+        if (len <= 0) {
+            *failed = (len < 0);
+            break;
+        }
+
+        sink->span(sink->arg, ring.data + (size_t)slot * ring.size, len);
+        times->hash += MDNow() - ready;
+
+        pthread_mutex_lock(&ring.lock);
+        ring.consumed++;
+        pthread_cond_broadcast(&ring.cond);
+        pthread_mutex_unlock(&ring.lock);
+    }
+
+    pthread_join(reader, NULL);
+    pthread_cond_destroy(&ring.cond);
+    pthread_mutex_destroy(&ring.lock);
+    free(ring.data);
+    return 0;
+}
+
+/* Reader thread of MDRingUpdate. Fills free slots in order until it has
+ * queued the end of the file. */
+static void *MDReadAhead(void *arg) {
+    MD_RING *ring = arg;
+
+    for (ssize_t len = 1; len > 0;) {
+        pthread_mutex_lock(&ring->lock);
+        while (ring->filled - ring->consumed == ring->count) {
+            pthread_cond_wait(&ring->cond, &ring->lock);
+        }
+        pthread_mutex_unlock(&ring->lock);
+
+        u32 slot = ring->filled % ring->count;
+        len = MDReadFull(ring->fd, ring->data + (size_t)slot * ring->size,
+                         ring->size);
+        if (len > 0) {
+            MD_COUNT(refills, 1);
+        }
+
+        pthread_mutex_lock(&ring->lock);
+        ring->len[slot] = len;
+        ring->filled++;
+        pthread_cond_broadcast(&ring->cond);
+        pthread_mutex_unlock(&ring->lock);
+    }
+
+    return NULL;
+}
+
+/* Reads until buffer holds len bytes or fd is at end of file. Returns
+ * the number of bytes read, or -1 on a read error with nothing read. */
+static ssize_t MDReadFull(i32 fd, u8 *buffer, u32 len) {
+    u32 done = 0;
+    while (done < len) {
+        ssize_t n = read(fd, buffer + done, len - done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return (done > 0) ? (ssize_t)done : n;
+        }
+        done += n;
+    }
+    return done;
+}
+
+/* Allocates len bytes aligned to a page, so that reads fill whole pages,
+ * or returns NULL. Free with free. */
+static u8 *MDAlloc(size_t len) {
+    void *p;
+    long page = sysconf(_SC_PAGESIZE);
+    if (posix_memalign(&p, (page > 0) ? (size_t)page : 4096, len) != 0) {
+        return NULL;
+    }
+    return p;
+}
+
+/* Returns a monotonic time in seconds. */
+static double MDNow(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Parses a size with an optional K, M or G suffix into len. Returns -1
+ * if size is malformed, zero or does not fit in 64 bits. */
+static i32 MDSize(char *size, u64 *len) {
+    if (*size < '0' || *size > '9') {
+        return -1;
+    }
+
+    char *end;
+    errno = 0;
+    *len = strtoull(size, &end, 10);
+    u32 shift = 0;
+    switch (*end) {
+    case 'G': shift += 10; /* fall through */
+    case 'M': shift += 10; /* fall through */
+    case 'K': shift += 10; end++; break;
+    }
+    if (errno == ERANGE || *len > UINT64_MAX >> shift) {
+        return -1;
+    }
+    *len <<= shift;
+    return (*end != '\0' || *len == 0) ? -1 : 0;
+}
+
+/* Sets the read buffer length. */
+static void MDBufferLen(char *size) {
+    u64 len;
+    if (MDSize(size, &len) != 0 || len > 0x80000000) {
+        printf("%s buffer size not supported\n", size);
+    } else {
+        readBufferLen = (u32)len;
+    }
+}
+
+/* Sets the part size for multipart digests. */
+static void MDPartLen(char *size) {
+    u64 len;
+    if (MDSize(size, &len) != 0) {
+        printf("%s part size not supported\n", size);
+    } else {
+        partLen = len;
+    }
+}
+
+/* Enables chunking, with the chunk index at path, or in memory if path
+ * is empty. */
+static void MDChunks(char *path) {
+    if (MDChunkIndexOpen((*path != '\0') ? path : NULL) != 0) {
+        printf("%s only one chunk index supported\n", path);
+        return;
+    }
+    if (chunker.max == 0) {
+        MDChunkerInit(&chunker, CHUNK_MIN, CHUNK_AVG, CHUNK_MAX);
+    }
+    chunking = 1;
+}
+
+/* Sets the chunk sizes for -d from "min,avg,max". */
+static void MDChunkSizes(char *sizes) {
+    char *size[3];
+    u64 len[3];
+    char copy[64];
+    snprintf(copy, sizeof(copy), "%s", sizes);
+
+    char *p = copy;
+    for (u32 i = 0; i < 3; i++) {
+        size[i] = p;
+        p += strcspn(p, ",");
+        if (*p != '\0' && i < 2) {
+            *p++ = '\0';
+        }
+    }
+    if (MDSize(size[0], &len[0]) != 0 || MDSize(size[1], &len[1]) != 0 ||
+        MDSize(size[2], &len[2]) != 0 ||
+        MDChunkerInit(&chunker, len[0], len[1], len[2]) != 0) {
+        printf("%s chunk sizes not supported\n", sizes);
+    }
+}
+
+/* Runs the hashing daemon at path until it is stopped. */
+static void MDServeOn(char *path) {
+    if (MDServe(path, threads, serveDeadline * 1000) != 0) {
+        printf("%s daemon can't be started\n", path);
+    }
+}
+
+/* Sets the daemon's batching deadline in microseconds. */
+static void MDDeadline(char *usec) {
+    char *end;
+    u64 n = strtoull(usec, &end, 10);
+    if (*end != '\0' || *usec == '\0' || n > 1000000) {
+        printf("%s deadline not supported\n", usec);
+    } else {
+        serveDeadline = n;
+    }
+}
+
+/* Runs the load generator from "path[,clients[,size]]". */
+static void MDLoadOn(char *spec) {
+    u64 clients = LOAD_CLIENTS;
+    u64 len = LOAD_LEN;
+    char *end = spec + strcspn(spec, ",");
+    i32 ok = (end > spec);
+    if (ok && *end == ',') {
+        *end++ = '\0';
+        clients = strtoull(end, &end, 10);
+        ok = (clients > 0 && clients <= 4096);
+    }
+    if (ok && *end == ',') {
+        ok = (MDSize(end + 1, &len) == 0 && len <= MD_SERVE_MAX_LEN);
+    } else if (*end != '\0') {
+        ok = 0;
+    }
+
+    if (!ok) {
+        printf("%s load not supported\n", spec);
+    } else {
+        MDLoad(spec, (u32)clients, (u32)len, benchJson);
+    }
+}
+
+/* Sets the number of -j workers; 0 means one per CPU. */
+static void MDThreads(char *count) {
+    char *end;
+    u64 n = strtoull(count, &end, 10);
+    if (*end != '\0' || n > 4096) {
+        printf("%s thread count not supported\n", count);
+    } else {
+        threads = MDPoolThreads((u32)n);
+    }
+}
+
+/* Checks the files listed in manifest against their digests and prints
+ * OK or FAILED for each, in order. Lines are in md5sum format ("digest
+ * name", two characters apart) or in the format printed for files; other
+ * lines are counted and skipped. The manifest is read WINDOW_FILES
+ * entries at a time, each window digested on the -j workers. */
+static void MDCheck(char *manifest) {
+    FILE *in = (strcmp(manifest, "-") == 0) ? stdin : fopen(manifest, "r");
+    MD_CHECK *check = calloc(1, sizeof(*check));
+    if (in == NULL || check == NULL) {
+        printf("%s can't be opened\n", manifest);
+        if (in != NULL && in != stdin) {
+            fclose(in);
+        }
+        free(check);
+        exitStatus = 1;
+        return;
+    }
+
+    char *line = NULL;
+    size_t size = 0;
+    ssize_t len;
+    u64 count = 0;
+    i32 stop = 0;
+    while (!stop && (len = getline(&line, &size, in)) >= 0) {
+        if (len > 0 && line[len - 1] == '\n') {
+            line[--len] = '\0';
+        }
+
+        char *name = MDParseLine(line, check->expected[count]);
+        if (name == NULL || (name = strdup(name)) == NULL) {
+            check->malformed++;
+            continue;
+        }
+        check->name[count++] = name;
+
+        if (count == WINDOW_FILES) {
+            stop = MDFilesFlat(check->name, count, MDCheckResult, check);
+            for (u64 i = 0; i < count; i++) {
+                free(check->name[i]);
+            }
+            count = 0;
+        }
+    }
+    if (!stop) {
+        MDFilesFlat(check->name, count, MDCheckResult, check);
+    }
+    for (u64 i = 0; i < count; i++) {
+        free(check->name[i]);
+    }
+    free(line);
+    if (in != stdin) {
+        fclose(in);
+    }
+    MDOutFlush();
+
+    if (check->malformed > 0) {
+        fprintf(stderr, "%s: WARNING: %llu %s improperly formatted\n",
+                manifest, (unsigned long long)check->malformed,
+                (check->malformed == 1) ? "line is" : "lines are");
+    }
+    if (check->unreadable > 0) {
+        fprintf(stderr, "%s: WARNING: %llu listed %s not be read\n", manifest,
+                (unsigned long long)check->unreadable,
+                (check->unreadable == 1) ? "file could" : "files could");
+    }
+    if (check->failed > 0) {
+        fprintf(stderr, "%s: WARNING: %llu computed %s NOT match\n",
+                manifest, (unsigned long long)check->failed,
+                (check->failed == 1) ? "checksum did" : "checksums did");
+    }
+    if (check->failed > 0 || check->unreadable > 0 ||
+        (check->matched == 0 && check->malformed > 0)) {
+        exitStatus = 1;
+    }
+    free(check);
+}
+
+/* Parses a manifest line into digest, and returns the file name in it,
+ * or NULL if the line is not well formed. A line starting with a
+ * backslash has a name with newlines and backslashes escaped. The line
+ * is modified. */
+static char *MDParseLine(char *line, u8 digest[16]) {
+    i32 escaped = (line[0] == '\\');
+    char *p = line + escaped;
+    char *name, *hex;
+
+    if (strncmp(p, "MD5 (", 5) == 0) {
+        char *end = strrchr(p, ')');
+        if (end == NULL || strncmp(end, ") = ", 4) != 0) {
+            return NULL;
+        }
+        *end = '\0';
+        name = p + 5;
+        hex = end + 4;
+    } else {
+        if (strlen(p) < 35 || p[32] != ' ' || (p[33] != ' ' && p[33] != '*')) {
+            return NULL;
+        }
+        p[32] = '\0';
+        name = p + 34;
+        hex = p;
+    }
+
+    if (strlen(hex) != 32) {
+        return NULL;
+    }
+    for (u32 i = 0; i < 32; i++) {
+        char c = hex[i];
+        u8 v;
+        if (c >= '0' && c <= '9') {
+            v = c - '0';
+        } else if (c >= 'a' && c <= 'f') {
+            v = c - 'a' + 10;
+        } else if (c >= 'A' && c <= 'F') {
+            v = c - 'A' + 10;
+        } else {
+            return NULL;
+        }
+        digest[i / 2] = (i % 2) ? (digest[i / 2] | v) : (u8)(v << 4);
+    }
+
+    if (escaped && MDUnescape(name) != 0) {
+        return NULL;
+    }
+    return name;
+}
+
+/* Replaces the escapes \\ and \n in name, in place. Returns -1 on any
+ * other escape. */
+static i32 MDUnescape(char *name) {
+    char *out = name;
+    for (char *in = name; *in != '\0'; in++) {
+        if (*in != '\\') {
+            *out++ = *in;
+        } else if (in[1] == '\\') {
+            *out++ = '\\';
+            in++;
+        } else if (in[1] == 'n') {
+            *out++ = '\n';
+            in++;
+        } else {
+            return -1;
+        }
+    }
+    *out = '\0';
+    return 0;
+}
+
+/* Prints the result of checking the i-th entry of an MD_CHECK window.
+ * Returns nonzero to stop at a failure under -e. */
+static i32 MDCheckResult(void *arg, u64 i, MD_FILE *file) {
+    MD_CHECK *check = arg;
+
+    MDPrintName(file->name);
+    i32 stop = stopAtMismatch;
+    if (file->status != 0) {
+        MDOutLiteral(": FAILED open or read\n");
+        check->unreadable++;
+    } else if (memcmp(file->digest, check->expected[i], 16) != 0) {
+        MDOutLiteral(": FAILED\n");
+        check->failed++;
+    } else {
+        MDOutLiteral(": OK\n");
+        check->matched++;
+        stop = 0;
+    }
+    MDOutEndLine();
+    return stop;
+}
+
+/* Prints a file name, escaped as md5sum does if it holds a newline. */
+static void MDPrintName(char *name) {
+    if (strchr(name, '\n') == NULL) {
+        MDOutWrite(name, strlen(name));
+        return;
+    }
+
+    MDOutLiteral("\\");
+    for (char *c = name; *c != '\0'; c++) {
+        if (*c == '\\') {
+            MDOutLiteral("\\\\");
+        } else if (*c == '\n') {
+            MDOutLiteral("\\n");
+        } else {
+            MDOutWrite(c, 1);
+        }
+    }
+}
+
+/* Enables statistics, from "" or "=perf" to read CPU counters too. */
+static void MDStats(char *mode) {
+    if (*mode != '\0' && strcmp(mode, "=perf") != 0) {
+        printf("%s statistics not supported\n", mode);
+    } else {
+        MDStatsStart(*mode != '\0');
+    }
+}
+
+/* Opens the digest cache at path. */
+static void MDCache(char *path) {
+    if (MDCacheOpen(path) != 0) {
+        printf("%s cache can't be opened (only one supported)\n", path);
+    } else {
+        useCache = 1;
+        verifySalt = (u64)time(NULL) * 0x9e3779b97f4a7c15 | 1;
+    }
+}
+
+/* Sets the share of cache hits that are digested again and compared,
+ * from "" (the default of 1 percent) or "=percent". */
+static void MDVerifyCache(char *percent) {
+    char *end = percent;
+    u64 p = 1;
+    if (*percent == '=') {
+        p = strtoull(percent + 1, &end, 10);
+    }
+
+    if (*end != '\0' || p > 100) {
+        printf("%s verify percentage not supported\n", percent);
+    } else {
+        verifyPercent = (u32)p;
+    }
+}
+
+/* Sets the number of read-ahead buffers. */
+static void MDBufferCount(char *count) {
+    char *end;
+    u64 n = strtoull(count, &end, 10);
+    if (*end != '\0' || n == 0 || n > MAX_READ_BUFFERS) {
+        printf("%s buffer count not supported\n", count);
+    } else {
+        readBuffers = (u32)n;
+    }
+}
+
+/* Digests the standard input and prints the result. Input redirected
+ * from a regular file is mapped like a named file; anything else goes
+ * through the read buffers, a pipe enlarged to one buffer length so
+ * that the writer can stay a buffer ahead. */
+static void MDFilter() {
+    MD_CTX context;
+    MDInit(&context);
+    MD_SINK sink = {MDContextSpan, &context};
+
+    MD_TIMES times = {0, 0};
+    struct stat st;
+    i32 fd = STDIN_FILENO;
+    i32 known = (fstat(fd, &st) == 0);
+#ifdef F_SETPIPE_SZ
+    if (known && S_ISFIFO(st.st_mode)) {
+        fcntl(fd, F_SETPIPE_SZ, (i32)readBufferLen);
+    }
+#endif
+    i32 status = 0;
+    if (!useMap || !known || !S_ISREG(st.st_mode) || st.st_size == 0 ||
+        lseek(fd, 0, SEEK_CUR) != 0 ||
+        MDMapUpdate(&sink, fd, st.st_size, &times) != 0) {
+        status = MDReadUpdate(&sink, fd, &times);
+    }
+
+    u8 digest[16];
+    MDFinal(digest, &context);
+
+    if (status != 0) {
+        MD_FILE file;
+        memset(&file, 0, sizeof(file));
+        file.name = "-";
+        file.status = FILE_UNREAD;
+        MDFileResult(NULL, 0, &file);
+    } else {
+        MDPrintResult(NULL, NULL, digest, NULL);
+    }
+    MDOutFlush();
+}
+
+/* Prints the digest of a line in the output mode, followed by its
+ * offset with --offsets. Binary records hold the offset big-endian. */
+static void MDPrintLine(u8 digest[16], u64 offset) {
+    if (outputMode == OUT_BINARY) {
+        MDOutWrite(digest, 16);
+        if (lineOffsets) {
+            MDOutBigEndian(offset, 8);
+        }
+    } else if (outputMode == OUT_JSON) {
+        MDOutLiteral("{\"md5\": \"");
+        MDOutHex(digest);
+        if (lineOffsets) {
+            MDOutLiteral("\", \"offset\": ");
+            MDOutDecimal(offset);
+            MDOutLiteral("}\n");
+        } else {
+            MDOutLiteral("\"}\n");
+        }
+    } else {
+        MDOutHex(digest);
+        if (lineOffsets) {
+            MDOutLiteral(" ");
+            MDOutDecimal(offset);
+        }
+        MDOutLiteral("\n");
+    }
+    MDOutEndLine();
+}
+
+/* Prints a digest in the output mode, labelled by key ("string" for
+ * -s, "file") and name, or unlabelled for standard input if key is
+ * NULL. For a file of several parts, the part count follows the digest
+ * with -p; the chunk counts go in JSON lines with -d, and the CRC32C and
+ * length follow the digest with -m. */
+static void MDPrintResult(const char *key, char *name, u8 digest[16],
+                          MD_FILE *file) {
+    i32 sums = (file != NULL && file->hasSums);
+    if (outputMode == OUT_BINARY) {
+        MDOutWrite(digest, 16);
+        if (sums) {
+            MDOutBigEndian(file->crc32c, 4);
+            MDOutBigEndian(file->len, 8);
+        }
+        if (name == NULL) {
+            MDOutWrite("-", 2);
+        } else {
+            MDOutWrite(name, strlen(name) + 1);
+        }
+        MDOutEndLine();
+        return;
+    }
+
+    char count[24];
+    i32 countLen = (file == NULL || partLen == 0 || file->parts <= 1)
+                       ? 0
+                       : snprintf(count, sizeof(count), "%llu",
+                                  (unsigned long long)file->parts);
+
+    if (outputMode == OUT_JSON) {
+        MDOutLiteral("{");
+        if (key != NULL) {
+            MDOutJson(key);
+            MDOutLiteral(": ");
+            MDOutJson(name);
+            MDOutLiteral(", ");
+        }
+        MDOutLiteral("\"md5\": \"");
+        MDOutHex(digest);
+        MDOutLiteral("\"");
+        if (countLen > 0) {
+            MDOutLiteral(", \"parts\": ");
+            MDOutWrite(count, countLen);
+        }
+        if (file != NULL && chunking && partLen == 0 && !resume) {
+            char chunks[80];
+            i32 len = snprintf(chunks, sizeof(chunks),
+                               ", \"chunks\": %llu, \"new_bytes\": %llu, "
+                               "\"duplicate_bytes\": %llu",
+                               (unsigned long long)file->chunks,
+                               (unsigned long long)file->newBytes,
+                               (unsigned long long)file->duplicateBytes);
+            MDOutWrite(chunks, len);
+        }
+        if (sums) {
+            char extra[64];
+            i32 len = snprintf(extra, sizeof(extra),
+                               ", \"crc32c\": \"%08x\", \"bytes\": %llu",
+                               file->crc32c, (unsigned long long)file->len);
+            MDOutWrite(extra, len);
+        }
+        MDOutLiteral("}\n");
+    } else {
+        if (key != NULL && strcmp(key, "string") == 0) {
+            MDOutLiteral("MD5 (\"");
+            MDOutWrite(name, strlen(name));
+            MDOutLiteral("\") = ");
+        } else if (key != NULL) {
+            MDOutLiteral("MD5 (");
+            MDOutWrite(name, strlen(name));
+            MDOutLiteral(") = ");
+        }
+        MDOutHex(digest);
+        if (countLen > 0) {
+            MDOutLiteral("-");
+            MDOutWrite(count, countLen);
+        }
+        if (sums) {
+            char extra[32];
+            i32 len = snprintf(extra, sizeof(extra), " %08x %llu",
+                               file->crc32c, (unsigned long long)file->len);
+            MDOutWrite(extra, len);
+        }
+        MDOutLiteral("\n");
     }
+    MDOutEndLine();
 }
@@ -0,0 +1,157 @@
+/* MDLINE.C - newline scanning for the MD driver */
+
+/* Records of -l mode end at newlines. Short records make a memchr per
+ * record cost more than the scan itself, so newlines are found 64 bytes
+ * at a time instead: a compare per vector gives a bit mask of the
+ * newlines, which is walked with count-trailing-zeros. SSE2 is part of
+ * x86-64; AVX2 is chosen at startup where the CPU has it. Elsewhere the
+ * scan falls back to memchr. */
+
+#include "global.h"
+#include "mdline.h"
+
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define MD_LINE_X86
+#define TARGET(isa) __attribute__((target(isa)))
+#else
+#define TARGET(isa)
+#endif
+
+static u64 EndsScalar(const u8 *, u64, u64 *, u64);
+#ifdef MD_LINE_X86
+static u64 EndsSSE2(const u8 *, u64, u64 *, u64);
+static u64 EndsAVX2(const u8 *, u64, u64 *, u64);
+#endif
+
+/* Newline scanner; chosen by MDLineInit at startup. */
+static u64 (*endsKernel)(const u8 *, u64, u64 *, u64) =
+#ifdef MD_LINE_X86
+    EndsSSE2;
+#else
+    EndsScalar;
+#endif
+
+/* Stores the offsets of the first max newlines in the len bytes at data
+ * into ends, in order. Returns the number stored; fewer than max means
+ * there are no more newlines in data. */
+u64 MDLineEnds(const u8 *data, u64 len, u64 *ends, u64 max) {
+    return endsKernel(data, len, ends, max);
+}
+
+/* Returns the i-th newline scanner the running CPU supports, and its
+ * name in name, or NULL once i is past the last one. For the
+ * self-test. */
+MD_LINE_KERNEL *MDLineKernel(u32 i, const char **name) {
+    if (i == 0) {
+        *name = "memchr";
+        return EndsScalar;
+    }
+#ifdef MD_LINE_X86
+    if (i == 1) {
+        *name = "sse2";
+        return EndsSSE2;
+    }
+    if (i == 2 && __builtin_cpu_supports("avx2")) {
+        *name = "avx2";
+        return EndsAVX2;
+    }
+#endif
+    return NULL;
+}
+
+/* Portable scanner. */
+static u64 EndsScalar(const u8 *data, u64 len, u64 *ends, u64 max) {
+    u64 n = 0;
+    const u8 *p = data;
+    const u8 *end = data + len;
+    while (n < max && p < end) {
+        const u8 *nl = memchr(p, '\n', end - p);
+        if (nl == NULL) {
+            break;
+        }
+        ends[n++] = nl - data;
+        p = nl + 1;
+    }
+    return n;
+}
+
+#ifdef MD_LINE_X86
+/* Stores the newline offsets base + i for the bits i of mask, up to max
+ * in all. */
+#define TAKE_MASK(mask, base)                                                  \
+    {                                                                          \
+        while (mask != 0) {                                                    \
+            ends[n++] = (base) + __builtin_ctzll(mask);                        \
+            if (n == max) {                                                    \
+                return n;                                                      \
+            }                                                                  \
+            mask &= mask - 1;                                                  \
+        }                                                                      \
+    }
+
+/* Four 16-byte compares per 64 bytes. */
+static u64 EndsSSE2(const u8 *data, u64 len, u64 *ends, u64 max) {
+    u64 n = 0;
+    if (max == 0) {
+        return 0;
+    }
+    __m128i nl = _mm_set1_epi8('\n');
+    u64 i = 0;
+    for (; i + 64 <= len; i += 64) {
+        const __m128i *p = (const __m128i *)(data + i);
+        u64 m0 = (u32)_mm_movemask_epi8(
+            _mm_cmpeq_epi8(_mm_loadu_si128(p), nl));
+        u64 m1 = (u32)_mm_movemask_epi8(
+            _mm_cmpeq_epi8(_mm_loadu_si128(p + 1), nl));
+        u64 m2 = (u32)_mm_movemask_epi8(
+            _mm_cmpeq_epi8(_mm_loadu_si128(p + 2), nl));
+        u64 m3 = (u32)_mm_movemask_epi8(
+            _mm_cmpeq_epi8(_mm_loadu_si128(p + 3), nl));
+        u64 mask = m0 | m1 << 16 | m2 << 32 | m3 << 48;
+        TAKE_MASK(mask, i);
+    }
+
+    u64 more = EndsScalar(data + i, len - i, ends + n, max - n);
+    for (u64 j = n; j < n + more; j++) {
+        ends[j] += i;
+    }
+    return n + more;
+}
+
+/* Two 32-byte compares per 64 bytes. */
+TARGET("avx2")
+static u64 EndsAVX2(const u8 *data, u64 len, u64 *ends, u64 max) {
+    u64 n = 0;
+    if (max == 0) {
+        return 0;
+    }
+    __m256i nl = _mm256_set1_epi8('\n');
+    u64 i = 0;
+    for (; i + 64 <= len; i += 64) {
+        const __m256i *p = (const __m256i *)(data + i);
+        u64 lo = (u32)_mm256_movemask_epi8(
+            _mm256_cmpeq_epi8(_mm256_loadu_si256(p), nl));
+        u64 hi = (u32)_mm256_movemask_epi8(
+            _mm256_cmpeq_epi8(_mm256_loadu_si256(p + 1), nl));
+        u64 mask = lo | hi << 32;
+        TAKE_MASK(mask, i);
+    }
+
+    u64 more = EndsScalar(data + i, len - i, ends + n, max - n);
+    for (u64 j = n; j < n + more; j++) {
+        ends[j] += i;
+    }
+    return n + more;
+}
+
+/* Selects the best scanner once at startup. */
+__attribute__((constructor)) static void MDLineInit(void) {
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        endsKernel = EndsAVX2;
+    }
+}
+#endif
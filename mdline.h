@@ -0,0 +1,5 @@
+/* MDLINE.H - header file for MDLINE.C */
+
+u64 MDLineEnds(const u8 *, u64, u64 *, u64);
+typedef u64 MD_LINE_KERNEL(const u8 *, u64, u64 *, u64);
+MD_LINE_KERNEL *MDLineKernel(u32, const char **);
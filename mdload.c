@@ -0,0 +1,261 @@
+/* MDLOAD.C - load generator for the MD hashing daemon */
+
+/* Runs closed-loop clients against a daemon: each client sends a
+ * message, waits for its digest, and sends the next one. Every step
+ * doubles the number of clients, from 1 up to a maximum, and runs for
+ * LOAD_NS; throughput rises with the clients until the daemon saturates,
+ * and from then on only latency does. Each step reports the requests
+ * per second and the median and 99th percentile round trip. Every digest
+ * is checked against one computed locally. */
+
+#include "global.h"
+#include "md5.h"
+#include "mdclient.h"
+#include "mdload.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define LOAD_NS 1e9
+#define LOAD_SAMPLES (1 << 20)
+
+/* The start of a step: clients wait for go, 1 to run until end or -1
+ * to give up. */
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    i32 go;
+    double end;
+} MD_START;
+
+/* One client of a step and its results. */
+typedef struct {
+    MD_CLIENT *client;
+    MD_START *start;
+    u8 *message;
+    u32 len;
+    u8 digest[16];
+    double *latency; /* ns per request, the first LOAD_SAMPLES */
+    u64 requests;
+    u64 errors;
+    double elapsed; /* ns */
+} MD_LOADER;
+
+static i32 Step(const char *, u32, u32, i32, i32);
+static i32 Prepare(MD_LOADER *, const char *, u32, u32);
+static void Report(MD_LOADER *, u32, i32, i32);
+static void *Client(void *);
+static double Percentile(double *, u64, u32);
+static double Now(void);
+static i32 CompareDoubles(const void *, const void *);
+
+/* Loads the daemon at path with 1, 2, 4, ... up to maxClients clients
+ * sending len-byte messages, and prints the results as a table, or as
+ * JSON if json is set. */
+void MDLoad(const char *path, u32 maxClients, u32 len, i32 json) {
+    if (json) {
+        printf("{\"benchmark\": \"md5-daemon\", \"bytes\": %u, "
+               "\"results\": [",
+               len);
+    } else {
+        printf("MD5 daemon load, messages of %u bytes\n", len);
+        printf("%8s %12s %12s %12s %8s\n", "clients", "requests/s", "p50 us",
+               "p99 us", "errors");
+    }
+
+    for (u32 clients = 1;; clients *= 2) {
+        if (clients > maxClients) {
+            clients = maxClients;
+        }
+        if (Step(path, clients, len, json, clients == 1) != 0) {
+            printf("%s can't be loaded with %u clients\n", path, clients);
+            break;
+        }
+        fflush(stdout);
+        if (clients == maxClients) {
+            break;
+        }
+    }
+
+    if (json) {
+        printf("\n]}\n");
+    }
+}
+
+/* Runs one step of the load with clients clients and prints its result.
+ * Returns -1 if the clients can't be set up. */
+static i32 Step(const char *path, u32 clients, u32 len, i32 json,
+                i32 first) {
+    MD_START start;
+    pthread_mutex_init(&start.lock, NULL);
+    pthread_cond_init(&start.cond, NULL);
+    start.go = 0;
+
+    MD_LOADER *loader = calloc(clients, sizeof(*loader));
+    pthread_t *thread = calloc(clients, sizeof(*thread));
+    u32 ready = 0;
+    for (; loader != NULL && thread != NULL && ready < clients; ready++) {
+        MD_LOADER *l = &loader[ready];
+        l->start = &start;
+        if (Prepare(l, path, len, ready) != 0 ||
+            pthread_create(&thread[ready], NULL, Client, l) != 0) {
+            break;
+        }
+    }
+
+    pthread_mutex_lock(&start.lock);
+    start.go = (ready == clients) ? 1 : -1;
+    start.end = Now() + LOAD_NS;
+    pthread_cond_broadcast(&start.cond);
+    pthread_mutex_unlock(&start.lock);
+
+    for (u32 i = 0; i < ready; i++) {
+        pthread_join(thread[i], NULL);
+    }
+    if (ready == clients) {
+        Report(loader, clients, json, first);
+    }
+
+    for (u32 i = 0; loader != NULL && i < clients; i++) {
+        if (loader[i].client != NULL) {
+            MDClientClose(loader[i].client);
+        }
+        free(loader[i].message);
+        free(loader[i].latency);
+    }
+    free(loader);
+    free(thread);
+    pthread_cond_destroy(&start.cond);
+    pthread_mutex_destroy(&start.lock);
+    return (ready == clients) ? 0 : -1;
+}
+
+/* Connects the i-th client of a step to path, with its own len-byte
+ * message and that message's digest. Returns -1 on failure. */
+static i32 Prepare(MD_LOADER *l, const char *path, u32 len, u32 i) {
+    l->client = MDClientOpen(path);
+    l->message = malloc(len ? len : 1);
+    l->latency = malloc(LOAD_SAMPLES * sizeof(*l->latency));
+    if (l->client == NULL || l->message == NULL || l->latency == NULL) {
+        return -1;
+    }
+    l->len = len;
+
+    u64 x = 0x9e3779b97f4a7c15 * (i + 1);
+    for (u32 j = 0; j < len; j++) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        l->message[j] = (u8)x;
+    }
+    MD5_CTX context;
+    MD5Init(&context);
+    MD5Update(&context, l->message, len);
+    MD5Final(l->digest, &context);
+    return 0;
+}
+
+/* Prints the result of a step with clients clients as a table row, or
+ * as a JSON object following first or later ones. */
+static void Report(MD_LOADER *loader, u32 clients, i32 json, i32 first) {
+    u64 samples = 0, requests = 0, errors = 0;
+    double elapsed = 0;
+    for (u32 i = 0; i < clients; i++) {
+        requests += loader[i].requests;
+        errors += loader[i].errors;
+        samples += (loader[i].requests < LOAD_SAMPLES) ? loader[i].requests
+                                                       : LOAD_SAMPLES;
+        if (loader[i].elapsed > elapsed) {
+            elapsed = loader[i].elapsed;
+        }
+    }
+
+    double *latency = malloc((samples ? samples : 1) * sizeof(*latency));
+    if (latency == NULL) {
+        samples = 0;
+    }
+    u64 n = 0;
+    for (u32 i = 0; i < clients && latency != NULL; i++) {
+        u64 kept = (loader[i].requests < LOAD_SAMPLES) ? loader[i].requests
+                                                       : LOAD_SAMPLES;
+        memcpy(latency + n, loader[i].latency, kept * sizeof(*latency));
+        n += kept;
+    }
+    if (latency != NULL) {
+        qsort(latency, samples, sizeof(*latency), CompareDoubles);
+    }
+
+    double rate = (elapsed > 0) ? requests * 1e9 / elapsed : 0;
+    double p50 = Percentile(latency, samples, 50) / 1e3;
+    double p99 = Percentile(latency, samples, 99) / 1e3;
+    if (json) {
+        printf("%s\n  {\"clients\": %u, \"requests\": %llu, "
+               "\"requests_per_s\": %.1f, \"latency_us\": {\"p50\": %.3f, "
+               "\"p99\": %.3f}, \"errors\": %llu}",
+               first ? "" : ",", clients, (unsigned long long)requests, rate,
+               p50, p99, (unsigned long long)errors);
+    } else {
+        printf("%8u %12.0f %12.1f %12.1f %8llu\n", clients, rate, p50, p99,
+               (unsigned long long)errors);
+    }
+    free(latency);
+}
+
+/* Client thread. Once the step starts, sends requests one at a time
+ * until its end, timing each round trip. */
+static void *Client(void *arg) {
+    MD_LOADER *l = arg;
+    pthread_mutex_lock(&l->start->lock);
+    while (l->start->go == 0) {
+        pthread_cond_wait(&l->start->cond, &l->start->lock);
+    }
+    i32 go = l->start->go;
+    double end = l->start->end;
+    pthread_mutex_unlock(&l->start->lock);
+    if (go < 0) {
+        return NULL;
+    }
+
+    double begin = Now();
+    double now = begin;
+    while (now < end) {
+        u8 digest[16];
+        double sent = now;
+        if (MDClientHash(l->client, l->message, l->len, digest) != 0) {
+            l->errors++;
+            break;
+        }
+        now = Now();
+        if (memcmp(digest, l->digest, 16) != 0) {
+            l->errors++;
+        }
+        if (l->requests < LOAD_SAMPLES) {
+            l->latency[l->requests] = now - sent;
+        }
+        l->requests++;
+    }
+    l->elapsed = now - begin;
+    return NULL;
+}
+
+/* Returns the p-th percentile of the n sorted values, by nearest rank,
+ * or 0 if there are none. */
+static double Percentile(double *sorted, u64 n, u32 p) {
+    return (n > 0) ? sorted[(n - 1) * p / 100] : 0;
+}
+
+/* Returns a monotonic time in nanoseconds. */
+static double Now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Orders doubles ascending. */
+static i32 CompareDoubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
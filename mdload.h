@@ -0,0 +1,3 @@
+/* MDLOAD.H - header file for MDLOAD.C */
+
+void MDLoad(const char *, u32, u32, i32);
@@ -0,0 +1,236 @@
+/* MDOUT.C - digest formatting and buffered output for the MD driver */
+
+/* Result lines are assembled in one large buffer and handed to write
+ * once it is full, or after every line while standard output is a
+ * terminal. Only whole lines are written; a line longer than the buffer
+ * is written straight through. Anything printed through stdio is
+ * flushed before each write, so the driver flushes this buffer before
+ * it prints through stdio again.
+ *
+ * Digests are converted to hexadecimal with a table lookup per nibble:
+ * one byte shuffle per 16 nibbles on SSSE3, a loop otherwise. A digest
+ * is only 32 nibbles, too few for a wider vector to pay off. */
+
+#include "global.h"
+#include "mdout.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define MD_OUT_X86
+#define TARGET(isa) __attribute__((target(isa)))
+#else
+#define TARGET(isa)
+#endif
+
+#define OUT_BUFFER_LEN (1 << 20)
+
+static char hexDigits[16] = {'0', '1', '2', '3', '4', '5', '6', '7',
+                             '8', '9', 'a', 'b', 'c', 'd', 'e', 'f'};
+
+static char outBuffer[OUT_BUFFER_LEN];
+static size_t outLen = 0;
+static size_t lineStart = 0; /* start of the line being assembled */
+static i32 interactive = 0;
+static i32 failed = 0;
+
+static void HexScalar(char[32], const u8[16]);
+#ifdef MD_OUT_X86
+static void HexSSSE3(char[32], const u8[16]);
+#endif
+static char *MDOutReserve(size_t);
+static void MDOutDrain(size_t);
+static void MDOutWriteAll(const char *, size_t);
+
+/* Hex encoder; chosen by MDOutInit at startup. */
+static void (*hexKernel)(char[32], const u8[16]) = HexScalar;
+
+/* Writes the 32 lowercase hexadecimal digits of digest to out, with no
+ * terminating null. */
+void MDHex(char out[32], const u8 digest[16]) { hexKernel(out, digest); }
+
+/* Returns the i-th hex encoder the running CPU supports, and its name in
+ * name, or NULL once i is past the last one. For the self-test. */
+MD_HEX_KERNEL *MDHexKernel(u32 i, const char **name) {
+    if (i == 0) {
+        *name = "scalar";
+        return HexScalar;
+    }
+#ifdef MD_OUT_X86
+    if (i == 1 && __builtin_cpu_supports("ssse3")) {
+        *name = "ssse3";
+        return HexSSSE3;
+    }
+#endif
+    return NULL;
+}
+
+/* Appends len bytes of data to the line being assembled. */
+void MDOutWrite(const void *data, size_t len) {
+    char *p = MDOutReserve(len);
+    if (p == NULL) {
+        MDOutWriteAll(data, len);
+    } else {
+        memcpy(p, data, len);
+    }
+}
+
+/* Appends digest in hexadecimal. */
+void MDOutHex(const u8 digest[16]) { MDHex(MDOutReserve(32), digest); }
+
+/* Appends n in decimal. */
+void MDOutDecimal(u64 n) {
+    char digits[20];
+    u32 len = 0;
+    do {
+        digits[sizeof(digits) - ++len] = (char)('0' + n % 10);
+        n /= 10;
+    } while (n != 0);
+    MDOutWrite(digits + sizeof(digits) - len, len);
+}
+
+/* Appends the low len bytes of n, most significant first, as binary
+ * records hold numbers. */
+void MDOutBigEndian(u64 n, u32 len) {
+    u8 bytes[8];
+    for (u32 i = 0; i < len; i++) {
+        bytes[i] = (u8)(n >> (8 * (len - 1 - i)));
+    }
+    MDOutWrite(bytes, len);
+}
+
+/* Appends s as a JSON string: quoted, with quotes, backslashes and
+ * control characters escaped. Other bytes are copied as they are. */
+void MDOutJson(const char *s) {
+    MDOutWrite("\"", 1);
+    for (;;) {
+        size_t run = 0;
+        while ((u8)s[run] >= 0x20 && s[run] != '"' && s[run] != '\\') {
+            run++;
+        }
+        MDOutWrite(s, run);
+        s += run;
+        if (*s == '\0') {
+            break;
+        }
+
+        char escape[6] = {'\\', *s, 0, 0, 0, 0};
+        size_t len = 2;
+        if (*s == '\n') {
+            escape[1] = 'n';
+        } else if (*s == '\t') {
+            escape[1] = 't';
+        } else if ((u8)*s < 0x20) {
+            escape[1] = 'u';
+            escape[2] = escape[3] = '0';
+            escape[4] = hexDigits[(u8)*s >> 4];
+            escape[5] = hexDigits[*s & 0xf];
+            len = 6;
+        }
+        MDOutWrite(escape, len);
+        s++;
+    }
+    MDOutWrite("\"", 1);
+}
+
+/* Ends the line being assembled. */
+void MDOutEndLine(void) {
+    lineStart = outLen;
+    if (interactive) {
+        MDOutFlush();
+    }
+}
+
+/* Writes out everything buffered. */
+void MDOutFlush(void) {
+    MDOutDrain(outLen);
+}
+
+/* Returns room for len more bytes of the current line, or NULL if the
+ * line no longer fits in the buffer. The finished lines are written out
+ * to make room. */
+static char *MDOutReserve(size_t len) {
+    if (outLen + len > OUT_BUFFER_LEN) {
+        MDOutDrain(lineStart);
+        if (outLen + len > OUT_BUFFER_LEN) {
+            MDOutDrain(outLen);
+            if (len > OUT_BUFFER_LEN) {
+                return NULL;
+            }
+        }
+    }
+    char *p = outBuffer + outLen;
+    outLen += len;
+    return p;
+}
+
+/* Writes out the first len buffered bytes and moves the rest to the
+ * front. */
+static void MDOutDrain(size_t len) {
+    if (len == 0) {
+        return;
+    }
+    MDOutWriteAll(outBuffer, len);
+    memmove(outBuffer, outBuffer + len, outLen - len);
+    outLen -= len;
+    lineStart = (lineStart > len) ? lineStart - len : 0;
+}
+
+/* Writes len bytes of data to standard output, after anything pending
+ * in stdio. Once a write fails, output is dropped. */
+static void MDOutWriteAll(const char *data, size_t len) {
+    fflush(stdout);
+    while (len > 0 && !failed) {
+        ssize_t n = write(STDOUT_FILENO, data, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            failed = 1;
+            break;
+        }
+        data += n;
+        len -= n;
+    }
+}
+
+/* Portable encoder. */
+static void HexScalar(char out[32], const u8 digest[16]) {
+    for (u32 i = 0; i < 16; i++) {
+        out[2 * i] = hexDigits[digest[i] >> 4];
+        out[2 * i + 1] = hexDigits[digest[i] & 0xf];
+    }
+}
+
+#ifdef MD_OUT_X86
+/* Looks up the high and the low nibbles of all 16 bytes with one
+ * shuffle each, then interleaves them into the two halves of out. */
+TARGET("ssse3")
+static void HexSSSE3(char out[32], const u8 digest[16]) {
+    __m128i table = _mm_loadu_si128((const __m128i *)hexDigits);
+    __m128i mask = _mm_set1_epi8(0x0f);
+    __m128i v = _mm_loadu_si128((const __m128i *)digest);
+
+    __m128i hi =
+        _mm_shuffle_epi8(table, _mm_and_si128(_mm_srli_epi16(v, 4), mask));
+    __m128i lo = _mm_shuffle_epi8(table, _mm_and_si128(v, mask));
+    _mm_storeu_si128((__m128i *)out, _mm_unpacklo_epi8(hi, lo));
+    _mm_storeu_si128((__m128i *)(out + 16), _mm_unpackhi_epi8(hi, lo));
+}
+#endif
+
+/* Selects the best hex encoder once at startup, and line-at-a-time
+ * output for a terminal. */
+__attribute__((constructor)) static void MDOutInit(void) {
+#ifdef MD_OUT_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("ssse3")) {
+        hexKernel = HexSSSE3;
+    }
+#endif
+    interactive = isatty(STDOUT_FILENO);
+}
@@ -0,0 +1,13 @@
+/* MDOUT.H - header file for MDOUT.C */
+
+void MDHex(char[32], const u8[16]);
+typedef void MD_HEX_KERNEL(char[32], const u8[16]);
+MD_HEX_KERNEL *MDHexKernel(u32, const char **);
+void MDOutWrite(const void *, size_t);
+#define MDOutLiteral(s) MDOutWrite((s), sizeof(s) - 1)
+void MDOutHex(const u8[16]);
+void MDOutDecimal(u64);
+void MDOutBigEndian(u64, u32);
+void MDOutJson(const char *);
+void MDOutEndLine(void);
+void MDOutFlush(void);
@@ -0,0 +1,179 @@
+/* MDPOOL.C - work-stealing thread pool for the MD driver */
+
+/* Each worker owns a contiguous range of task indices and runs it from
+ * the front. A worker that runs out steals the back half of the largest
+ * range left, so an expensive index never holds up the cheap ones queued
+ * behind it. */
+
+#include "global.h"
+#include "mdpool.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+/* One worker thread and the range of indices it owns. */
+typedef struct {
+    MD_POOL *pool;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    u64 next; /* next index to run */
+    u64 end;  /* end of the owned range */
+} MD_WORKER;
+
+struct MD_POOL {
+    MD_TASK task;
+    void *arg;
+    u32 workers; /* workers, including ones that failed to start */
+    u32 started; /* worker threads running */
+    MD_WORKER *worker;
+};
+
+static void *MDWorker(void *);
+static i32 MDSteal(MD_WORKER *);
+
+/* Starts threads workers running task(arg, i) for every i in [0, n) and
+ * returns without waiting for them. Indices are split evenly over the
+ * workers, in order. If no thread can be started, the tasks run on the
+ * calling thread before MDPoolStart returns. Tasks may run concurrently
+ * and in any order. */
+MD_POOL *MDPoolStart(u32 threads, u64 n, MD_TASK task, void *arg) {
+    if (threads == 0) {
+        threads = 1;
+    }
+
+    MD_POOL *pool = malloc(sizeof(*pool));
+    MD_WORKER *worker = malloc(threads * sizeof(*worker));
+    if (pool == NULL || worker == NULL) {
+        free(pool);
+        free(worker);
+        for (u64 i = 0; i < n; i++) {
+            task(arg, i);
+        }
+        return NULL;
+    }
+
+    pool->task = task;
+    pool->arg = arg;
+    pool->workers = threads;
+    pool->started = 0;
+    pool->worker = worker;
+    for (u32 w = 0; w < threads; w++) {
+        worker[w].pool = pool;
+        worker[w].next = n * w / threads;
+        worker[w].end = n * (w + 1) / threads;
+        pthread_mutex_init(&worker[w].lock, NULL);
+    }
+
+    /* Workers that fail to start leave their ranges to be stolen. */
+    for (u32 w = 0; w < threads; w++) {
+        if (pthread_create(&worker[w].thread, NULL, MDWorker, &worker[w]) !=
+            0) {
+            break;
+        }
+        pool->started++;
+    }
+
+    if (pool->started == 0) {
+        MDWorker(&worker[0]);
+    }
+    return pool;
+}
+
+/* Waits until every task of pool has run, then frees pool. */
+void MDPoolWait(MD_POOL *pool) {
+    if (pool == NULL) {
+        return;
+    }
+
+    for (u32 w = 0; w < pool->started; w++) {
+        pthread_join(pool->worker[w].thread, NULL);
+    }
+    for (u32 w = 0; w < pool->workers; w++) {
+        pthread_mutex_destroy(&pool->worker[w].lock);
+    }
+    free(pool->worker);
+    free(pool);
+}
+
+/* Runs task(arg, i) for every i in [0, n) on threads workers. */
+void MDPoolRun(u32 threads, u64 n, MD_TASK task, void *arg) {
+    MDPoolWait(MDPoolStart(threads, n, task, arg));
+}
+
+/* Returns threads, or the number of online CPUs if threads is 0. */
+u32 MDPoolThreads(u32 threads) {
+    if (threads == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = (cpus > 0) ? (u32)cpus : 1;
+    }
+    return threads;
+}
+
+/* Worker thread. Runs its own range, then steals until no work is
+ * left. */
+static void *MDWorker(void *arg) {
+    MD_WORKER *self = arg;
+    MD_POOL *pool = self->pool;
+
+    do {
+        for (;;) {
+            pthread_mutex_lock(&self->lock);
+            if (self->next == self->end) {
+                pthread_mutex_unlock(&self->lock);
+                break;
+            }
+            u64 i = self->next++;
+            pthread_mutex_unlock(&self->lock);
+
+            pool->task(pool->arg, i);
+        }
+    } while (MDSteal(self));
+
+    return NULL;
+}
+
+/* Moves the back half of the largest range of the other workers into
+ * the (empty) range of self. Returns 0 if there was nothing to steal.
+ * Ranges of workers that never started are included. */
+static i32 MDSteal(MD_WORKER *self) {
+    MD_POOL *pool = self->pool;
+
+    for (;;) {
+        MD_WORKER *victim = NULL;
+        u64 most = 0;
+        for (MD_WORKER *w = pool->worker; w < pool->worker + pool->workers;
+             w++) {
+            if (w == self) {
+                continue;
+            }
+            pthread_mutex_lock(&w->lock);
+            u64 left = w->end - w->next;
+            pthread_mutex_unlock(&w->lock);
+            if (left > most) {
+                most = left;
+                victim = w;
+            }
+        }
+        if (victim == NULL) {
+            return 0;
+        }
+
+        /* The victim may have moved on since; retry if it is empty. */
+        pthread_mutex_lock(&victim->lock);
+        u64 left = victim->end - victim->next;
+        u64 mid = victim->end - (left + 1) / 2;
+        u64 end = victim->end;
+        victim->end = mid;
+        pthread_mutex_unlock(&victim->lock);
+        if (left == 0) {
+            continue;
+        }
+
+        pthread_mutex_lock(&self->lock);
+        self->next = mid;
+        self->end = end;
+        pthread_mutex_unlock(&self->lock);
+        return 1;
+    }
+}
@@ -0,0 +1,11 @@
+/* MDPOOL.H - header file for MDPOOL.C */
+
+/* A task is called once for every index in [0, n). */
+typedef void (*MD_TASK)(void *, u64);
+
+typedef struct MD_POOL MD_POOL;
+
+MD_POOL *MDPoolStart(u32, u64, MD_TASK, void *);
+void MDPoolWait(MD_POOL *);
+void MDPoolRun(u32, u64, MD_TASK, void *);
+u32 MDPoolThreads(u32);
@@ -0,0 +1,549 @@
+/* MDSERVE.C - hashing daemon for the MD driver */
+
+#define _GNU_SOURCE /* ppoll */
+
+/* Many processes that each hash a trickle of small messages never fill
+ * the SIMD lanes on their own. The daemon gathers their messages and
+ * digests them side by side with MD5Batch.
+ *
+ * Clients connect to a Unix stream socket and send requests in the
+ * format of mdclient.h. One thread polls the connections and queues
+ * every complete request. Workers take requests off the queue in
+ * batches of up to SERVE_BATCH messages or SERVE_BATCH_LEN bytes: as
+ * soon as enough are queued to fill the widest kernel's lanes, or once
+ * the oldest has waited for the deadline, which bounds the latency
+ * batching adds. Replies are sent by the worker that digested the
+ * request, one send per run of requests from the same connection.
+ *
+ * Client sockets are non-blocking, so that no client can stall a worker
+ * or the poller by not reading its replies. What a socket can't take is
+ * queued on the connection and sent by the poller when the socket is
+ * writable; while SERVE_OUT_LIMIT bytes are queued, the connection's
+ * requests are not read.
+ *
+ * A connection is freed once the client has gone and none of its
+ * requests are queued or being digested; its descriptor stays open
+ * until then, so a late reply can't reach a reused descriptor. */
+
+#include "global.h"
+#include "md5.h"
+#include "mdclient.h"
+#include "mdserve.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/prctl.h>
+#endif
+
+#define SERVE_BATCH 64
+#define SERVE_BATCH_LEN (1 << 20)
+#define SERVE_CONNS 1024
+#define SERVE_BUFFER_LEN (64 << 10)
+#define SERVE_OUT_LIMIT (256 << 10)
+
+/* A client connection. refs counts the poller, while the client is
+ * connected, and every request of the connection not yet replied to.
+ * sendLock guards the output. */
+typedef struct {
+    i32 fd;
+    u32 refs;
+    pthread_mutex_t sendLock;
+    u8 *buffer; /* received bytes not yet queued */
+    u64 have;
+    u64 size;
+    u8 *out; /* replies the socket has not taken yet */
+    u64 outLen;
+    u64 outSize;
+    i32 failed; /* the client can't be sent to any more */
+} MD_CONN;
+
+/* A queued request and its message. */
+typedef struct MD_JOB {
+    struct MD_JOB *next;
+    MD_CONN *conn;
+    u64 tag;
+    u32 len;
+    double arrival;
+    u8 data[];
+} MD_JOB;
+
+/* The request queue shared by the poller and the workers. */
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    MD_JOB *head;
+    MD_JOB **tail;
+    u64 queued;
+    u32 lanes;       /* queued requests that start a batch at once */
+    double deadline; /* seconds a request may wait for a batch */
+} MD_QUEUE;
+
+static MD_QUEUE queue;
+static volatile sig_atomic_t stopping = 0;
+static i32 wake[2]; /* written to wake the poller for new output */
+
+static i32 MDListen(const char *);
+static MD_CONN *MDConnOpen(i32);
+static void MDConnRelease(MD_CONN *, u32);
+static i32 MDConnRead(MD_CONN *);
+static i32 MDConnRefuse(MD_CONN *, u64);
+static short MDConnEvents(MD_CONN *);
+static void *MDServeWorker(void *);
+static u32 MDTakeBatch(MD_JOB **);
+static void MDReply(MD_JOB **, u8 (*)[16], u32);
+static void MDConnSend(MD_CONN *, const void *, size_t);
+static void MDConnFlush(MD_CONN *);
+static void MDStop(i32);
+static double Now(void);
+
+/* Serves digests on a Unix socket at path with workers threads, holding
+ * requests for at most deadline nanoseconds to fill a batch. Runs until
+ * interrupted or terminated, then removes the socket. Returns -1 if the
+ * daemon can't be started. */
+i32 MDServe(const char *path, u32 workers, u64 deadline) {
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_mutex_init(&queue.lock, NULL);
+    pthread_cond_init(&queue.cond, &attr);
+    pthread_condattr_destroy(&attr);
+    queue.head = NULL;
+    queue.tail = &queue.head;
+    queue.queued = 0;
+    queue.lanes = MD5MaxLanes();
+    queue.deadline = deadline / 1e9;
+
+    i32 listener = MDListen(path);
+    if (listener < 0) {
+        return -1;
+    }
+    if (pipe(wake) != 0) {
+        close(listener);
+        unlink(path);
+        return -1;
+    }
+    for (u32 i = 0; i < 2; i++) {
+        fcntl(wake[i], F_SETFL, O_NONBLOCK);
+        fcntl(wake[i], F_SETFD, FD_CLOEXEC);
+    }
+
+    /* The stop signals stay blocked outside ppoll, so that one arriving
+     * between the check of stopping and the wait still ends the wait.
+     * Workers inherit the mask and never see them. */
+    sigset_t stop, old;
+    sigemptyset(&stop);
+    sigaddset(&stop, SIGINT);
+    sigaddset(&stop, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &stop, &old);
+    u32 started = 0;
+    for (u32 i = 0; i < workers; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, MDServeWorker, NULL) == 0) {
+            pthread_detach(thread);
+            started++;
+        }
+    }
+    if (started == 0) {
+        pthread_sigmask(SIG_SETMASK, &old, NULL);
+        close(listener);
+        unlink(path);
+        return -1;
+    }
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = MDStop;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    sigset_t waiting = old;
+    sigdelset(&waiting, SIGINT);
+    sigdelset(&waiting, SIGTERM);
+
+    /* Slot 0 is the listener and slot 1 the wake pipe; the connections
+     * follow. */
+    struct pollfd fds[SERVE_CONNS + 2];
+    MD_CONN *conn[SERVE_CONNS + 2];
+    u32 conns = 2;
+    fds[0].fd = listener;
+    fds[0].events = POLLIN;
+    fds[1].fd = wake[0];
+    fds[1].events = POLLIN;
+
+    while (!stopping) {
+        for (u32 i = 2; i < conns; i++) {
+            fds[i].events = MDConnEvents(conn[i]);
+        }
+        if (ppoll(fds, conns, NULL, &waiting) < 0) {
+            continue;
+        }
+
+        if (fds[1].revents & POLLIN) {
+            u8 drain[64];
+            while (read(wake[0], drain, sizeof(drain)) > 0) {
+            }
+        }
+
+        for (u32 i = conns - 1; i > 1; i--) {
+            if (fds[i].revents & POLLOUT) {
+                pthread_mutex_lock(&conn[i]->sendLock);
+                MDConnFlush(conn[i]);
+                pthread_mutex_unlock(&conn[i]->sendLock);
+            }
+            if ((fds[i].revents & (POLLIN | POLLHUP | POLLERR)) &&
+                MDConnRead(conn[i]) != 0) {
+                MDConnRelease(conn[i], 1);
+                conns--;
+                fds[i] = fds[conns];
+                conn[i] = conn[conns];
+            }
+        }
+
+        if (fds[0].revents & POLLIN) {
+            i32 fd = accept(listener, NULL, NULL);
+            if (fd >= 0 && (conns == SERVE_CONNS + 2 ||
+                            fcntl(fd, F_SETFL, O_NONBLOCK) != 0)) {
+                close(fd);
+            } else if (fd >= 0) {
+                conn[conns] = MDConnOpen(fd);
+                if (conn[conns] == NULL) {
+                    close(fd);
+                } else {
+                    fds[conns].fd = fd;
+                    fds[conns].events = POLLIN;
+                    conns++;
+                }
+            }
+        }
+    }
+
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    close(listener);
+    unlink(path);
+    return 0;
+}
+
+/* Binds and listens on a Unix socket at path, replacing a stale one.
+ * Returns the socket, or -1. */
+static i32 MDListen(const char *path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    i32 fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    unlink(path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        listen(fd, SOMAXCONN) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* Returns a new connection on fd, or NULL. */
+static MD_CONN *MDConnOpen(i32 fd) {
+    MD_CONN *conn = malloc(sizeof(*conn));
+    if (conn == NULL) {
+        return NULL;
+    }
+    conn->buffer = malloc(SERVE_BUFFER_LEN);
+    if (conn->buffer == NULL) {
+        free(conn);
+        return NULL;
+    }
+    conn->fd = fd;
+    conn->refs = 1;
+    pthread_mutex_init(&conn->sendLock, NULL);
+    conn->have = 0;
+    conn->size = SERVE_BUFFER_LEN;
+    conn->out = NULL;
+    conn->outLen = conn->outSize = 0;
+    conn->failed = 0;
+    return conn;
+}
+
+/* Drops n references to conn, freeing it with the last. */
+static void MDConnRelease(MD_CONN *conn, u32 n) {
+    pthread_mutex_lock(&queue.lock);
+    conn->refs -= n;
+    u32 refs = conn->refs;
+    pthread_mutex_unlock(&queue.lock);
+
+    if (refs == 0) {
+        close(conn->fd);
+        pthread_mutex_destroy(&conn->sendLock);
+        free(conn->buffer);
+        free(conn->out);
+        free(conn);
+    }
+}
+
+/* Reads what the client sent and queues its complete requests. Returns
+ * -1 once the connection is to be dropped: at end of file, on an error,
+ * or after a request too long to serve. */
+static i32 MDConnRead(MD_CONN *conn) {
+    ssize_t n = read(conn->fd, conn->buffer + conn->have,
+                     conn->size - conn->have);
+    if (n < 0 && (errno == EINTR || errno == EAGAIN)) {
+        return 0;
+    }
+    if (n <= 0) {
+        return -1;
+    }
+    conn->have += n;
+
+    MD_JOB *head = NULL;
+    MD_JOB **tail = &head;
+    u32 jobs = 0;
+    u64 used = 0;
+    i32 status = 0;
+    double arrival = Now();
+    while (conn->have - used >= sizeof(MD_REQUEST)) {
+        MD_REQUEST request;
+        memcpy(&request, conn->buffer + used, sizeof(request));
+        if (request.len > MD_SERVE_MAX_LEN) {
+            status = MDConnRefuse(conn, request.tag);
+            break;
+        }
+
+        u64 need = sizeof(request) + request.len;
+        if (conn->have - used < need) {
+            /* Make room for the whole request. */
+            if (need > conn->size) {
+                u8 *buffer = realloc(conn->buffer, need);
+                if (buffer == NULL) {
+                    status = -1;
+                    break;
+                }
+                conn->buffer = buffer;
+                conn->size = need;
+            }
+            break;
+        }
+
+        MD_JOB *job = malloc(sizeof(*job) + request.len);
+        if (job == NULL) {
+            status = -1;
+            break;
+        }
+        job->conn = conn;
+        job->tag = request.tag;
+        job->len = request.len;
+        job->arrival = arrival;
+        memcpy(job->data, conn->buffer + used + sizeof(request), job->len);
+        *tail = job;
+        tail = &job->next;
+        jobs++;
+        used += need;
+    }
+    memmove(conn->buffer, conn->buffer + used, conn->have - used);
+    conn->have -= used;
+
+    if (jobs > 0) {
+        *tail = NULL;
+        pthread_mutex_lock(&queue.lock);
+        conn->refs += jobs;
+        *queue.tail = head;
+        queue.tail = tail;
+        queue.queued += jobs;
+        pthread_cond_signal(&queue.cond);
+        pthread_mutex_unlock(&queue.lock);
+    }
+    return status;
+}
+
+/* Replies to the request under tag that it is too long. Returns -1.
+ * The reply, like any output still queued, only goes out if the socket
+ * takes it now: the connection is dropped. */
+static i32 MDConnRefuse(MD_CONN *conn, u64 tag) {
+    MD_REPLY reply;
+    memset(&reply, 0, sizeof(reply));
+    reply.tag = tag;
+    reply.status = -1;
+    MDConnSend(conn, &reply, sizeof(reply));
+    return -1;
+}
+
+/* Returns the events to poll conn for: output while some is queued, and
+ * requests unless too much output is. */
+static short MDConnEvents(MD_CONN *conn) {
+    pthread_mutex_lock(&conn->sendLock);
+    u64 queued = conn->failed ? 0 : conn->outLen;
+    pthread_mutex_unlock(&conn->sendLock);
+    return ((queued < SERVE_OUT_LIMIT) ? POLLIN : 0) |
+           ((queued > 0) ? POLLOUT : 0);
+}
+
+/* Worker thread. Digests batches off the queue and replies. */
+static void *MDServeWorker(void *arg) {
+    (void)arg;
+#ifdef PR_SET_TIMERSLACK
+    /* The default slack of 50 microseconds would dwarf short deadlines. */
+    prctl(PR_SET_TIMERSLACK, 1);
+#endif
+    MD_JOB *job[SERVE_BATCH];
+    const u8 *input[SERVE_BATCH];
+    u64 len[SERVE_BATCH];
+    u8 digest[SERVE_BATCH][16];
+
+    for (;;) {
+        u32 n = MDTakeBatch(job);
+        for (u32 i = 0; i < n; i++) {
+            input[i] = job[i]->data;
+            len[i] = job[i]->len;
+        }
+        MD5Batch(input, len, digest, n);
+        MDReply(job, digest, n);
+    }
+    return NULL;
+}
+
+/* Waits for a batch to be due and takes it off the queue into job.
+ * Returns the number of requests taken. */
+static u32 MDTakeBatch(MD_JOB **job) {
+    pthread_mutex_lock(&queue.lock);
+    for (;;) {
+        if (queue.queued >= queue.lanes) {
+            break;
+        }
+        if (queue.queued == 0) {
+            pthread_cond_wait(&queue.cond, &queue.lock);
+            continue;
+        }
+
+        double due = queue.head->arrival + queue.deadline;
+        if (Now() >= due) {
+            break;
+        }
+        struct timespec ts;
+        ts.tv_sec = (time_t)due;
+        ts.tv_nsec = (long)((due - ts.tv_sec) * 1e9);
+        pthread_cond_timedwait(&queue.cond, &queue.lock, &ts);
+    }
+
+    u32 n = 0;
+    u64 bytes = 0;
+    while (queue.head != NULL && n < SERVE_BATCH &&
+           (n == 0 || bytes + queue.head->len <= SERVE_BATCH_LEN)) {
+        job[n] = queue.head;
+        bytes += job[n++]->len;
+        queue.head = queue.head->next;
+        queue.queued--;
+    }
+    if (queue.head == NULL) {
+        queue.tail = &queue.head;
+    } else {
+        /* Let another worker look at what is left. */
+        pthread_cond_signal(&queue.cond);
+    }
+    pthread_mutex_unlock(&queue.lock);
+    return n;
+}
+
+/* Sends the digests of n jobs, one send per run of jobs of the same
+ * connection, and frees the jobs. */
+static void MDReply(MD_JOB **job, u8 (*digest)[16], u32 n) {
+    MD_REPLY reply[SERVE_BATCH];
+    for (u32 first = 0, i = 0; first < n; first = i) {
+        MD_CONN *conn = job[first]->conn;
+        for (i = first; i < n && job[i]->conn == conn; i++) {
+            MD_REPLY *r = &reply[i - first];
+            r->tag = job[i]->tag;
+            r->status = 0;
+            r->reserved = 0;
+            memcpy(r->digest, digest[i], 16);
+            free(job[i]);
+        }
+        MDConnSend(conn, reply, (i - first) * sizeof(*reply));
+        MDConnRelease(conn, i - first);
+    }
+}
+
+/* Sends len bytes of data to conn without blocking. What the socket
+ * can't take now is queued, and the poller woken to send it. A client
+ * that has gone away just misses its replies. */
+static void MDConnSend(MD_CONN *conn, const void *data, size_t len) {
+    pthread_mutex_lock(&conn->sendLock);
+    if (!conn->failed && conn->outLen + len > conn->outSize) {
+        u64 size = 2 * conn->outSize;
+        if (size < conn->outLen + len) {
+            size = conn->outLen + len;
+        }
+        u8 *out = realloc(conn->out, size);
+        if (out == NULL) {
+            conn->failed = 1;
+        } else {
+            conn->out = out;
+            conn->outSize = size;
+        }
+    }
+    i32 queued = 0;
+    if (!conn->failed) {
+        memcpy(conn->out + conn->outLen, data, len);
+        conn->outLen += len;
+        MDConnFlush(conn);
+        queued = (conn->outLen > 0);
+    }
+    pthread_mutex_unlock(&conn->sendLock);
+
+    if (queued) {
+        u8 byte = 0;
+        /* A full pipe means the poller is due to wake anyway. */
+        (void)!write(wake[1], &byte, 1);
+    }
+}
+
+/* Sends as much of the output queued on conn as its socket takes now.
+ * Call with sendLock held. */
+static void MDConnFlush(MD_CONN *conn) {
+    u64 sent = 0;
+    while (sent < conn->outLen) {
+        ssize_t n = send(conn->fd, conn->out + sent, conn->outLen - sent,
+                         MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        }
+        if (n <= 0) {
+            conn->failed = 1;
+            sent = conn->outLen;
+            break;
+        }
+        sent += n;
+    }
+    memmove(conn->out, conn->out + sent, conn->outLen - sent);
+    conn->outLen -= sent;
+}
+
+/* Signal handler: ends the poll loop. */
+static void MDStop(i32 signal) {
+    (void)signal;
+    stopping = 1;
+}
+
+/* Returns a monotonic time in seconds. */
+static double Now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
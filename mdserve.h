@@ -0,0 +1,3 @@
+/* MDSERVE.H - header file for MDSERVE.C */
+
+i32 MDServe(const char *, u32, u64);
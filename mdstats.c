@@ -0,0 +1,170 @@
+/* MDSTATS.C - run statistics for the MD driver */
+
+/* Counters are only touched while statistics are enabled. The MD5
+ * library counts its own calls and blocks (MD5StatsRead); the driver
+ * adds files, buffer refills and I/O and compute time. On Linux, the
+ * process can also count cycles, instructions and last-level cache
+ * misses with perf_event_open; the counters are inherited by threads
+ * started afterwards. */
+
+#include "global.h"
+#include "md5.h"
+#include "mdstats.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#endif
+
+i32 mdStatsEnabled = 0;
+MD_STATS mdStats;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static double start = 0;
+static i32 perfWanted = 0;
+static i32 perfFd[3] = {-1, -1, -1}; /* cycles, instructions, LLC misses */
+
+static i32 MDPerfOpen(u64);
+static u64 MDPerfRead(i32);
+static double MDStatsNow(void);
+
+/* Enables statistics, and the perf counters too if perf is set and the
+ * system allows it. */
+void MDStatsStart(i32 perf) {
+    if (mdStatsEnabled) {
+        return;
+    }
+
+    memset(&mdStats, 0, sizeof(mdStats));
+    start = MDStatsNow();
+    perfWanted = perf;
+#ifdef __linux__
+    if (perf) {
+        perfFd[0] = MDPerfOpen(PERF_COUNT_HW_CPU_CYCLES);
+        perfFd[1] = MDPerfOpen(PERF_COUNT_HW_INSTRUCTIONS);
+        perfFd[2] = MDPerfOpen(PERF_COUNT_HW_CACHE_MISSES);
+    }
+#endif
+
+    mdStatsEnabled = 1;
+    MD5StatsEnable(1);
+}
+
+/* Counts a file with status as returned by MDFileDigest, and the I/O
+ * and compute time spent on it. */
+void MDStatsFile(i32 status, double io, double hash) {
+    if (!mdStatsEnabled) {
+        return;
+    }
+
+    MD_COUNT(files, 1);
+    MD_COUNT(unreadable, status != 0);
+
+    pthread_mutex_lock(&lock);
+    mdStats.io += io;
+    mdStats.hash += hash;
+    pthread_mutex_unlock(&lock);
+}
+
+/* Reads the statistics so far into stats. The counters are atomic, as
+ * MD_COUNT adds to them; the times are kept under the lock. */
+void MDStatsRead(MD_STATS *stats) {
+    memset(stats, 0, sizeof(*stats));
+    stats->files = __atomic_load_n(&mdStats.files, __ATOMIC_RELAXED);
+    stats->unreadable =
+        __atomic_load_n(&mdStats.unreadable, __ATOMIC_RELAXED);
+    stats->mapped = __atomic_load_n(&mdStats.mapped, __ATOMIC_RELAXED);
+    stats->cached = __atomic_load_n(&mdStats.cached, __ATOMIC_RELAXED);
+    stats->refills = __atomic_load_n(&mdStats.refills, __ATOMIC_RELAXED);
+
+    pthread_mutex_lock(&lock);
+    stats->io = mdStats.io;
+    stats->hash = mdStats.hash;
+    pthread_mutex_unlock(&lock);
+
+    stats->wall = mdStatsEnabled ? MDStatsNow() - start : 0;
+    stats->perf = (perfFd[0] >= 0 && perfFd[1] >= 0 && perfFd[2] >= 0);
+    stats->cycles = MDPerfRead(perfFd[0]);
+    stats->instructions = MDPerfRead(perfFd[1]);
+    stats->llcMisses = MDPerfRead(perfFd[2]);
+    MD5StatsRead(&stats->md5);
+}
+
+/* Prints a summary of the statistics so far on stderr, after any
+ * output pending on stdout. I/O and compute times add up over files, so
+ * with several workers they can exceed the wall time. */
+void MDStatsPrint(void) {
+    MD_STATS s;
+    MDStatsRead(&s);
+    fflush(stdout);
+
+    fprintf(stderr,
+            "stats: %llu files, %llu unreadable, %llu mapped, %llu cached\n",
+            (unsigned long long)s.files, (unsigned long long)s.unreadable,
+            (unsigned long long)s.mapped, (unsigned long long)s.cached);
+    fprintf(stderr,
+            "stats: %llu bytes, %llu MD5Update calls, %llu blocks, "
+            "%llu lane blocks\n",
+            (unsigned long long)s.md5.bytes, (unsigned long long)s.md5.updates,
+            (unsigned long long)s.md5.blocks,
+            (unsigned long long)s.md5.laneBlocks);
+    fprintf(stderr, "stats: %llu buffer refills\n",
+            (unsigned long long)s.refills);
+    fprintf(stderr,
+            "stats: %.6f s wall, %.6f s I/O wait, %.6f s compute, "
+            "%.1f MB/s\n",
+            s.wall, s.io, s.hash,
+            (s.wall > 0) ? s.md5.bytes / s.wall / 1e6 : 0.0);
+    if (s.perf) {
+        fprintf(stderr,
+                "stats: %llu cycles, %llu instructions (%.2f per cycle), "
+                "%llu LLC misses\n",
+                (unsigned long long)s.cycles,
+                (unsigned long long)s.instructions,
+                s.cycles ? (double)s.instructions / s.cycles : 0.0,
+                (unsigned long long)s.llcMisses);
+    } else if (perfWanted) {
+        fprintf(stderr, "stats: perf counters unavailable\n");
+    }
+}
+
+/* Opens a user-space hardware counter of config for this process and
+ * the threads it starts. Returns its descriptor, or -1. */
+static i32 MDPerfOpen(u64 config) {
+#ifdef __linux__
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = config;
+    attr.inherit = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return (i32)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+#else
+    (void)config;
+    return -1;
+#endif
+}
+
+/* Reads the counter open on fd, or returns 0 if there is none. */
+static u64 MDPerfRead(i32 fd) {
+    u64 value = 0;
+    if (fd < 0 || read(fd, &value, sizeof(value)) != sizeof(value)) {
+        return 0;
+    }
+    return value;
+}
+
+/* Returns a monotonic time in seconds. */
+static double MDStatsNow(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
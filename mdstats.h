@@ -0,0 +1,35 @@
+/* MDSTATS.H - header file for MDSTATS.C */
+
+/* Statistics of a driver run. The perf counters are only valid if perf
+ * is set. */
+typedef struct {
+    u64 files;      /* files digested or failed */
+    u64 unreadable; /* files that can't be opened */
+    u64 mapped;     /* files digested through a mapping */
+    u64 cached;     /* files whose digest came from the cache */
+    u64 refills;    /* read buffers filled */
+    double io;      /* seconds waiting for file data, over all files */
+    double hash;    /* seconds digesting, over all files */
+    double wall;    /* seconds since MDStatsStart */
+    i32 perf;
+    u64 cycles;
+    u64 instructions;
+    u64 llcMisses;
+    MD5_STATS md5;
+} MD_STATS;
+
+/* MD_COUNT adds n to counter field of mdStats while statistics are
+ * enabled; the branch is all it costs otherwise. */
+extern i32 mdStatsEnabled;
+extern MD_STATS mdStats;
+#define MD_COUNT(field, n)                                                     \
+    {                                                                          \
+        if (__builtin_expect(mdStatsEnabled, 0)) {                             \
+            __atomic_add_fetch(&mdStats.field, (n), __ATOMIC_RELAXED);         \
+        }                                                                      \
+    }
+
+void MDStatsStart(i32);
+void MDStatsFile(i32, double, double);
+void MDStatsRead(MD_STATS *);
+void MDStatsPrint(void);
@@ -0,0 +1,166 @@
+/* MDSUMS.C - single-pass MD5, CRC32C and length for the MD driver */
+
+/* Data is fed to MD5 and CRC32C a slice of SUMS_SLICE bytes at a time,
+ * so that the CRC reads the slice from L1 right after MD5 has. CRC32C
+ * (the Castagnoli polynomial, as in iSCSI and ext4) uses the SSE4.2
+ * crc32 instruction, 8 bytes at a time, where the CPU has it, and
+ * slicing-by-8 tables otherwise. Either way it costs a fraction of MD5,
+ * so a single CRC stream keeps up. */
+
+#include "global.h"
+#include "md5.h"
+#include "mdsums.h"
+
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define MD_SUMS_X86
+#define TARGET(isa) __attribute__((target(isa)))
+#else
+#define TARGET(isa)
+#endif
+
+#define SUMS_SLICE 8192
+#define CRC32C_POLY 0x82f63b78 /* reflected */
+
+static u32 crcTable[8][256];
+
+static u32 CrcTables(u32, const u8 *, u64);
+#ifdef MD_SUMS_X86
+static u32 CrcSSE42(u32, const u8 *, u64);
+#endif
+
+/* CRC32C kernel; chosen by MDSumsSetup at startup. */
+static u32 (*crcKernel)(u32, const u8 *, u64) = CrcTables;
+static const char *crcKernelName = "tables";
+
+/* Starts MD5, CRC32C and length over. */
+void MDSumsInit(MD_SUMS_CTX *context) {
+    MD5Init(&context->md5);
+    context->crc = 0xffffffff;
+    context->len = 0;
+}
+
+/* Adds the len bytes at input to all three sums, slice by slice. */
+void MDSumsUpdate(MD_SUMS_CTX *context, const u8 *input, u64 len) {
+    context->len += len;
+    while (len > 0) {
+        u64 slice = (len < SUMS_SLICE) ? len : SUMS_SLICE;
+        MD5Update64(&context->md5, input, slice);
+        context->crc = crcKernel(context->crc, input, slice);
+        input += slice;
+        len -= slice;
+    }
+}
+
+/* Stores the three sums into sums, and zeroizes the context. */
+void MDSumsFinal(MD_SUMS *sums, MD_SUMS_CTX *context) {
+    MD5Final(sums->md5, &context->md5);
+    sums->crc32c = ~context->crc;
+    sums->len = context->len;
+    memset(context, 0, sizeof(*context));
+}
+
+/* Computes the sums of the len bytes at input in one call. */
+void MDSums(MD_SUMS *sums, const u8 *input, u64 len) {
+    MD_SUMS_CTX context;
+    MDSumsInit(&context);
+    MDSumsUpdate(&context, input, len);
+    MDSumsFinal(sums, &context);
+}
+
+/* Continues the CRC32C crc, 0 for none yet, over the len bytes at
+ * input. */
+u32 MDCrc32c(u32 crc, const u8 *input, u64 len) {
+    return ~crcKernel(~crc, input, len);
+}
+
+/* Returns the name of the CRC32C kernel in use. */
+const char *MDCrc32cKernel(void) { return crcKernelName; }
+
+/* Returns the i-th CRC32C kernel the running CPU supports, and its name
+ * in name, or NULL once i is past the last one. Kernels work on the
+ * inverted CRC. For the self-test. */
+MD_CRC_KERNEL *MDCrcKernel(u32 i, const char **name) {
+    if (i == 0) {
+        *name = "tables";
+        return CrcTables;
+    }
+#ifdef MD_SUMS_X86
+    if (i == 1 && __builtin_cpu_supports("sse4.2")) {
+        *name = "sse4.2";
+        return CrcSSE42;
+    }
+#endif
+    return NULL;
+}
+
+/* Slicing-by-8: eight table lookups per 8 bytes. Works on the inverted
+ * CRC. */
+static u32 CrcTables(u32 crc, const u8 *input, u64 len) {
+    while (len > 0 && ((uintptr_t)input & 7) != 0) {
+        crc = crcTable[0][(crc ^ *input++) & 0xff] ^ (crc >> 8);
+        len--;
+    }
+    for (; len >= 8; input += 8, len -= 8) {
+        u32 lo = crc ^ ((u32)input[0] | (u32)input[1] << 8 |
+                        (u32)input[2] << 16 | (u32)input[3] << 24);
+        u32 hi = (u32)input[4] | (u32)input[5] << 8 | (u32)input[6] << 16 |
+                 (u32)input[7] << 24;
+        crc = crcTable[7][lo & 0xff] ^ crcTable[6][(lo >> 8) & 0xff] ^
+              crcTable[5][(lo >> 16) & 0xff] ^ crcTable[4][lo >> 24] ^
+              crcTable[3][hi & 0xff] ^ crcTable[2][(hi >> 8) & 0xff] ^
+              crcTable[1][(hi >> 16) & 0xff] ^ crcTable[0][hi >> 24];
+    }
+    while (len-- > 0) {
+        crc = crcTable[0][(crc ^ *input++) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#ifdef MD_SUMS_X86
+/* The crc32 instruction, 8 bytes at a time. */
+TARGET("sse4.2")
+static u32 CrcSSE42(u32 crc, const u8 *input, u64 len) {
+    u64 c = crc;
+    while (len > 0 && ((uintptr_t)input & 7) != 0) {
+        c = _mm_crc32_u8((u32)c, *input++);
+        len--;
+    }
+    for (; len >= 8; input += 8, len -= 8) {
+        u64 word;
+        memcpy(&word, input, 8);
+        c = _mm_crc32_u64(c, word);
+    }
+    while (len-- > 0) {
+        c = _mm_crc32_u8((u32)c, *input++);
+    }
+    return (u32)c;
+}
+#endif
+
+/* Builds the tables and selects the CRC32C kernel once at startup. */
+__attribute__((constructor)) static void MDSumsSetup(void) {
+    for (u32 i = 0; i < 256; i++) {
+        u32 crc = i;
+        for (u32 k = 0; k < 8; k++) {
+            crc = (crc >> 1) ^ (CRC32C_POLY & (0 - (crc & 1)));
+        }
+        crcTable[0][i] = crc;
+    }
+    for (u32 i = 0; i < 256; i++) {
+        for (u32 t = 1; t < 8; t++) {
+            crcTable[t][i] = crcTable[t - 1][i] >> 8 ^
+                             crcTable[0][crcTable[t - 1][i] & 0xff];
+        }
+    }
+
+#ifdef MD_SUMS_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2")) {
+        crcKernel = CrcSSE42;
+        crcKernelName = "sse4.2";
+    }
+#endif
+}
@@ -0,0 +1,24 @@
+/* MDSUMS.H - header file for MDSUMS.C */
+
+/* MD5, CRC32C and length of the same data, computed in one pass. */
+typedef struct {
+    MD5_CTX md5;
+    u32 crc; /* inverted CRC32C so far */
+    u64 len;
+} MD_SUMS_CTX;
+
+typedef struct {
+    u8 md5[16];
+    u32 crc32c;
+    u64 len;
+} MD_SUMS;
+
+void MDSumsInit(MD_SUMS_CTX *);
+void MDSumsUpdate(MD_SUMS_CTX *, const u8 *, u64);
+void MDSumsFinal(MD_SUMS *, MD_SUMS_CTX *);
+void MDSums(MD_SUMS *, const u8 *, u64);
+
+u32 MDCrc32c(u32, const u8 *, u64);
+const char *MDCrc32cKernel(void);
+typedef u32 MD_CRC_KERNEL(u32, const u8 *, u64);
+MD_CRC_KERNEL *MDCrcKernel(u32, const char **);